@@ -0,0 +1,84 @@
+#ifndef CLUSTERSEQUENCECACHE_H
+#define CLUSTERSEQUENCECACHE_H 1
+
+#include <EVENT/LCEvent.h>
+#include <EVENT/ReconstructedParticle.h>
+
+#include <fastjet/ClusterSequence.hh>
+#include <fastjet/PseudoJet.hh>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef std::vector< fastjet::PseudoJet > PseudoJetList;
+/// the particles of the input collection, indexed like the collection
+typedef std::vector< EVENT::ReconstructedParticle* > ParticleTable;
+
+/**
+ * Event-scoped store of converted input particles and their ClusterSequence.
+ *
+ * Processors clustering the same input collection with the same jet definition
+ * and recombination scheme find the clustering of the first processor here and
+ * reuse it instead of converting and clustering again. All entries are dropped
+ * as soon as a different event is seen.
+ */
+class ClusterSequenceCache {
+
+public:
+  struct Entry {
+    PseudoJetList pjList{};
+    /// typed pointers to all input particles, the user_index of the pseudo jets points in here
+    ParticleTable particles{};
+    /// input particles left out of the clustering, to be attached to the jets afterwards
+    PseudoJetList softList{};
+    /// background density estimated from the input particles
+    double rho{0.0};
+    double sigma{0.0};
+    std::shared_ptr<fastjet::ClusterSequence> cs{};
+  };
+  typedef std::shared_ptr<Entry> EntryPtr;
+
+  /// the cache shared by all processors of the job
+  static ClusterSequenceCache& instance() {
+    static ClusterSequenceCache cache;
+    return cache;
+  }
+
+  /// returns the entry stored for this event under key, or an empty pointer
+  EntryPtr find(const EVENT::LCEvent* evt, const std::string& key) {
+    startEvent(evt);
+    std::map<std::string, EntryPtr>::const_iterator it = _entries.find(key);
+    return it == _entries.end() ? EntryPtr() : it->second;
+  }
+
+  /// store the entry for this event under key
+  void insert(const EVENT::LCEvent* evt, const std::string& key, const EntryPtr& entry) {
+    startEvent(evt);
+    _entries[key] = entry;
+  }
+
+private:
+  ClusterSequenceCache(): _event(NULL), _runNumber(-1), _eventNumber(-1), _entries() {}
+  ClusterSequenceCache(const ClusterSequenceCache&) = delete;
+  ClusterSequenceCache& operator=(const ClusterSequenceCache&) = delete;
+
+  void startEvent(const EVENT::LCEvent* evt) {
+    if (evt == _event && evt->getRunNumber() == _runNumber && evt->getEventNumber() == _eventNumber) {
+      return;
+    }
+    _entries.clear();
+    _event = evt;
+    _runNumber = evt->getRunNumber();
+    _eventNumber = evt->getEventNumber();
+  }
+
+  const EVENT::LCEvent* _event;
+  int _runNumber;
+  int _eventNumber;
+  std::map<std::string, EntryPtr> _entries;
+
+}; //end class ClusterSequenceCache
+
+#endif // CLUSTERSEQUENCECACHE_H
@@ -0,0 +1,189 @@
+#ifndef CLUSTERINGHISTORY_H
+#define CLUSTERINGHISTORY_H 1
+
+#include <EVENT/LCCollection.h>
+#include <EVENT/LCGenericObject.h>
+#include <EVENT/ReconstructedParticle.h>
+#include <Exceptions.h>
+#include <IMPL/LCGenericObjectImpl.h>
+
+#include <fastjet/ClusterSequence.hh>
+#include <fastjet/PseudoJet.hh>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+/**
+ * Compact merge history of one ClusterSequence, stored as a single LCGenericObject.
+ *
+ * Every clustering of N particles takes N steps, each merging two jets or one jet
+ * with the beam. Step s creates the jet with history index N+s, the particles have
+ * the history indices 0 to N-1. The object holds
+ *  - ints:    N, the input collection index of each particle, then parent1 and parent2
+ *             of each step (parent2 is -1 for a merge with the beam)
+ *  - doubles: Q2 of the event, then the dij of each step
+ *
+ * The reader gives the exclusive jets at any N, dcut or ycut and the candidates for
+ * inclusive jets as lists of input collection indices, in time linear in the number
+ * of particles and without reclustering. The jet four-vectors are the sums of the
+ * constituents (E_scheme). This is only meaningful for algorithms with a sequential
+ * recombination history, e.g. kt, ee_kt, Valencia, and not for cone algorithms.
+ */
+class ClusteringHistory {
+
+public:
+  typedef std::vector< std::vector<int> > JetIndices;
+
+  /// create the storage object for a ClusterSequence
+  static IMPL::LCGenericObjectImpl* create(const fastjet::ClusterSequence& cs) {
+
+    const std::vector<fastjet::ClusterSequence::history_element>& history = cs.history();
+    const int nParticles = cs.n_particles();
+    const int nSteps = history.size() - nParticles;
+
+    IMPL::LCGenericObjectImpl* obj = new IMPL::LCGenericObjectImpl(1 + nParticles + 2*nSteps, 0, 1 + nSteps);
+    obj->setIntVal(0, nParticles);
+    for (int i = 0; i < nParticles; ++i) {
+      obj->setIntVal(1 + i, cs.jets()[history[i].jetp_index].user_index());
+    }
+    obj->setDoubleVal(0, cs.Q2());
+    for (int s = 0; s < nSteps; ++s) {
+      const fastjet::ClusterSequence::history_element& step = history[nParticles + s];
+      obj->setIntVal(1 + nParticles + 2*s, step.parent1);
+      obj->setIntVal(2 + nParticles + 2*s, step.parent2 == fastjet::ClusterSequence::BeamJet ? -1 : step.parent2);
+      obj->setDoubleVal(1 + s, step.dij);
+    }
+    return obj;
+  }
+
+  /// read the history from its storage object
+  explicit ClusteringHistory(const EVENT::LCGenericObject* obj)
+    : _inputIndex(), _parent1(), _parent2(), _dij(), _maxDij(), _Q2(0.0) {
+
+    if (obj->getNInt() < 1 || obj->getNDouble() < 1) {
+      throw EVENT::Exception("ClusteringHistory: object does not contain a clustering history");
+    }
+    const int nParticles = obj->getIntVal(0);
+    const int nSteps = obj->getNDouble() - 1;
+    if (nParticles < 0 || obj->getNInt() != 1 + nParticles + 2*nSteps) {
+      throw EVENT::Exception("ClusteringHistory: inconsistent number of entries");
+    }
+
+    _inputIndex.resize(nParticles);
+    for (int i = 0; i < nParticles; ++i) {
+      _inputIndex[i] = obj->getIntVal(1 + i);
+    }
+    _Q2 = obj->getDoubleVal(0);
+    _parent1.resize(nSteps);
+    _parent2.resize(nSteps);
+    _dij.resize(nSteps);
+    _maxDij.resize(nSteps);
+    for (int s = 0; s < nSteps; ++s) {
+      _parent1[s] = obj->getIntVal(1 + nParticles + 2*s);
+      _parent2[s] = obj->getIntVal(2 + nParticles + 2*s);
+      _dij[s] = obj->getDoubleVal(1 + s);
+      _maxDij[s] = std::max(_dij[s], s > 0 ? _maxDij[s-1] : 0.0);
+    }
+  }
+
+  unsigned nParticles() const { return _inputIndex.size(); }
+  double Q2() const { return _Q2; }
+
+  /// number of exclusive jets with all merges above dcut, like ClusterSequence::n_exclusive_jets
+  int nExclusiveJets(double dcut) const {
+    int s = _dij.size();
+    while (s > 0 && _maxDij[s-1] > dcut) --s;
+    return _dij.size() - s;
+  }
+  int nExclusiveJetsYcut(double ycut) const { return nExclusiveJets(ycut*_Q2); }
+
+  /// dij of the merge that goes from njets+1 to njets jets, like ClusterSequence::exclusive_dmerge
+  double exclusiveDmerge(int njets) const {
+    const int s = int(_dij.size()) - njets - 1;
+    return s >= 0 && s < int(_dij.size()) ? _dij[s] : 0.0;
+  }
+  double exclusiveYmerge(int njets) const { return _Q2 > 0 ? exclusiveDmerge(njets)/_Q2 : 0.0; }
+
+  /// input collection indices of the constituents of the exclusive jets
+  JetIndices exclusiveJets(int njets) const {
+
+    const int nParts = nParticles();
+    if (njets > nParts || njets < 0) {
+      std::stringstream err;
+      err << "ClusteringHistory: requested " << njets << " exclusive jets, but there were only " << nParts << " particles";
+      throw EVENT::Exception(err.str());
+    }
+
+    // the jets are the parents of the last njets steps that were created before them
+    const int stopPoint = 2*nParts - njets;
+    JetIndices jets;
+    jets.reserve(njets);
+    for (int h = stopPoint; h < nParts + int(_dij.size()); ++h) {
+      const int s = h - nParts;
+      if (_parent1[s] < stopPoint) jets.push_back(constituents(_parent1[s]));
+      if (_parent2[s] >= 0 && _parent2[s] < stopPoint) jets.push_back(constituents(_parent2[s]));
+    }
+    return jets;
+  }
+  JetIndices exclusiveJetsDcut(double dcut) const { return exclusiveJets(nExclusiveJets(dcut)); }
+  JetIndices exclusiveJetsYcut(double ycut) const { return exclusiveJets(nExclusiveJetsYcut(ycut)); }
+
+  /// input collection indices of the constituents of all jets merged with the beam, the
+  /// inclusive jets are the ones passing the pt cut applied to their four-vectors
+  JetIndices inclusiveJets() const {
+    JetIndices jets;
+    for (unsigned s = 0; s < _dij.size(); ++s) {
+      if (_parent2[s] < 0) jets.push_back(constituents(_parent1[s]));
+    }
+    return jets;
+  }
+
+  /// sum the four-vectors of the constituents, the user_index of each jet is its position in the list
+  static std::vector<fastjet::PseudoJet> jetMomenta(const JetIndices& jets, EVENT::LCCollection* recCol) {
+    std::vector<fastjet::PseudoJet> momenta;
+    momenta.reserve(jets.size());
+    for (unsigned j = 0; j < jets.size(); ++j) {
+      double px = 0, py = 0, pz = 0, E = 0;
+      for (unsigned n = 0; n < jets[j].size(); ++n) {
+	const EVENT::ReconstructedParticle* par = static_cast<EVENT::ReconstructedParticle*>(recCol->getElementAt(jets[j][n]));
+	px += par->getMomentum()[0];
+	py += par->getMomentum()[1];
+	pz += par->getMomentum()[2];
+	E += par->getEnergy();
+      }
+      momenta.push_back(fastjet::PseudoJet(px, py, pz, E));
+      momenta.back().set_user_index(j);
+    }
+    return momenta;
+  }
+
+private:
+  /// all particles below the history element, each node of the tree is visited once
+  std::vector<int> constituents(int node) const {
+    std::vector<int> result;
+    std::vector<int> todo(1, node);
+    const int nParts = nParticles();
+    while (!todo.empty()) {
+      const int h = todo.back();
+      todo.pop_back();
+      if (h < nParts) {
+	result.push_back(_inputIndex[h]);
+      } else {
+	todo.push_back(_parent1[h - nParts]);
+	if (_parent2[h - nParts] >= 0) todo.push_back(_parent2[h - nParts]);
+      }
+    }
+    return result;
+  }
+
+  std::vector<int> _inputIndex;
+  std::vector<int> _parent1;
+  std::vector<int> _parent2;
+  std::vector<double> _dij;
+  std::vector<double> _maxDij;
+  double _Q2;
+
+}; //end class ClusteringHistory
+
+#endif // CLUSTERINGHISTORY_H
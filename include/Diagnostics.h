@@ -0,0 +1,142 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H 1
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Counts the per-event warnings (empty input, skipped events, ...) by reason and decides which of
+ * them are worth a log line: the first maxMessages of each reason, then every sampleEvery-th. With
+ * summaryEvery > 0, tick() asks for a summary of all counts every summaryEvery events. The counts can
+ * be read at any time, e.g. in end(). All methods can be called from several threads.
+ *
+ * streamlog itself must only be written to from the thread Marlin runs the processor on. Threads
+ * working on parts of one event keep their messages in a Capture instead, the thread that started
+ * them writes the messages after joining them.
+ */
+class Diagnostics {
+
+public:
+  /// a log message kept for the processor thread
+  struct Message {
+    bool warning;
+    std::string text;
+  };
+
+  /// while it exists, the messages of this thread go to the given list instead of streamlog
+  class Capture {
+  public:
+    explicit Capture(std::vector<Message>& messages): _messages(messages), _previous(active()) { active() = this; }
+    ~Capture() { active() = _previous; }
+
+    /// the list of the Capture of this thread, NULL if there is none
+    static std::vector<Message>* messages() { return active() ? &active()->_messages : NULL; }
+
+  private:
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+
+    static Capture*& active() {
+      static thread_local Capture* capture = NULL;
+      return capture;
+    }
+
+    std::vector<Message>& _messages;
+    Capture* _previous;
+  };
+
+  Diagnostics(): _maxMessages(10), _sampleEvery(1000), _summaryEvery(0), _events(0), _counts(), _mutex() {}
+
+  Diagnostics(const Diagnostics& rhs):
+    _maxMessages(rhs._maxMessages),
+    _sampleEvery(rhs._sampleEvery),
+    _summaryEvery(rhs._summaryEvery),
+    _events(rhs._events),
+    _counts(rhs.counts()),
+    _mutex()
+  {}
+
+  Diagnostics& operator=(const Diagnostics& rhs) {
+    if (this == &rhs) return *this;
+    const std::map<std::string, long> counts = rhs.counts();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _maxMessages = rhs._maxMessages;
+    _sampleEvery = rhs._sampleEvery;
+    _summaryEvery = rhs._summaryEvery;
+    _events = rhs._events;
+    _counts = counts;
+    return *this;
+  }
+
+  void configure(long maxMessages, long sampleEvery, long summaryEvery) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _maxMessages = maxMessages;
+    _sampleEvery = sampleEvery;
+    _summaryEvery = summaryEvery;
+  }
+
+  /// counts one occurrence of reason, returns its number if a message should be written and 0 if not
+  long report(const std::string& reason) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const long n = ++_counts[reason];
+    if (n <= _maxMessages || (_sampleEvery > 0 && n % _sampleEvery == 0)) return n;
+    return 0;
+  }
+
+  /// to append to the message of occurrence n, says when the following ones are left out
+  std::string note(long n) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ostringstream note;
+    if (n == _maxMessages && _sampleEvery <= 0) {
+      note << " (message " << n << ", no more are written)";
+    } else if (n == _maxMessages) {
+      note << " (message " << n << ", from now on only every " << _sampleEvery << "th is written)";
+    } else if (n > _maxMessages) {
+      note << " (occurrence " << n << ")";
+    }
+    return note.str();
+  }
+
+  /// counts one event, true if a summary is due
+  bool tick() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_events;
+    return _summaryEvery > 0 && _events % _summaryEvery == 0;
+  }
+
+  long count(const std::string& reason) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::map<std::string, long>::const_iterator it = _counts.find(reason);
+    return it == _counts.end() ? 0 : it->second;
+  }
+
+  std::map<std::string, long> counts() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _counts;
+  }
+
+  /// one line with the counts of all reasons
+  std::string summary() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ostringstream summary;
+    summary << _events << " events";
+    for (std::map<std::string, long>::const_iterator it = _counts.begin(); it != _counts.end(); ++it) {
+      summary << " - " << it->first << ": " << it->second;
+    }
+    return summary.str();
+  }
+
+private:
+  long _maxMessages;
+  long _sampleEvery;
+  long _summaryEvery;
+  long _events;
+  std::map<std::string, long> _counts;
+  mutable std::mutex _mutex;
+
+}; //end class Diagnostics
+
+#endif
@@ -9,7 +9,13 @@
 #ifndef FASTJETPROCESSOR_H_
 #define FASTJETPROCESSOR_H_
 
+#include "ClusterSequenceCache.h"
 #include "EClusterMode.h"
+#include "InputVariation.h"
+#include "JetColumnFile.h"
+#include "JetResultCache.h"
+#include "ScanResult.h"
+#include "TruthGhosts.h"
 
 #include "marlin/Processor.h"
 #include "marlin/VerbosityLevels.h"
@@ -21,6 +27,7 @@
 #include <fastjet/PseudoJet.hh>
 #include <fastjet/JetDefinition.hh>
 
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -60,18 +67,88 @@ public:
 
 private:
 
+  /// state of one event handed from one stage of the jet finding to the next
+  struct EventJets {
+    LCEvent* evt{NULL};
+    LCCollection* particleIn{NULL};
+    LCCollection* mcIn{NULL};
+    /// the MC truth ghosts at the end of the input of the clustering
+    unsigned nTruthGhosts{0};
+    ClusterSequenceCache::EntryPtr clustering{};
+    PseudoJetList jets{};
+    std::vector<PseudoJetList> softConstituents{};
+    /// no jets are searched, the output collections stay empty
+    bool skippedEmpty{false};
+    /// the input collection does not exist, not counted as a skipped empty event
+    bool missingInput{false};
+    bool skippedFixedNrJets{false};
+    bool skippedMaxIterations{false};
+    bool budgetFallback{false};
+    IMPL::LCCollectionVec* lccJetsOut{NULL};
+    IMPL::LCCollectionVec* lccParticlesOut{NULL};
+    IMPL::LCCollectionVec* lccHistoryOut{NULL};
+    std::uint64_t inputHash{0};
+    JetResultCache::RecordPtr cached{};
+    // constituents of jet j are constituentIndices[constituentBegin[j]] up to [constituentBegin[j+1]-1]
+    EVENT::IntVec constituentBegin{};
+    EVENT::IntVec constituentIndices{};
+    /// the systematic variation these jets were found with, NULL for the nominal jets
+    const InputVariation* variation{NULL};
+    std::vector<std::unique_ptr<EventJets> > variations{};
+    /// the jets of each point of the scanGrid
+    std::vector<ScanResult> scan{};
+  };
+
+  // the stages of processEvent
+  bool readInput(EventJets& ev);
+  void convertInput(EventJets& ev);
+  void findJets(EventJets& ev);
+  void findVariationJets(EventJets& ev);
+  void buildOutput(EventJets& ev);
+  void restoreOutput(EventJets& ev);
+  void registerOutput(EventJets& ev);
+
+  // everything the jets depend on apart from the input, to tell the results of different settings apart
+  std::string configuration() const;
+  void writeStatistics(const std::string& fileName) const;
+
   // the LC Collection names for input/output
   std::string	_lcParticleInName;
   std::string	_lcParticleOutName;
   std::string	_lcJetOutName;
+  std::string	_lcHistoryOutName;
 
   int  _statsFoundJets;
   int _statsNrEvents;
   int _statsNrSkippedEmptyEvents;
   int _statsNrSkippedFixedNrJets;
   int _statsNrSkippedMaxIterations;
+  int _statsNrBudgetFallbacks;
   bool _storeParticlesInJets;
 
+  // jets of earlier jobs with the same settings, read instead of clustering again
+  std::string _jetCacheFileName;
+  JetResultCache* _jetCache;
+
+  // columnar copy of the jets for the analysis, see JetColumnFile.h
+  std::string _jetColumnFileName;
+  JetColumnWriter* _jetColumns;
+
+  // the input is varied and clustered again for each of them, see InputVariation.h
+  EVENT::StringVec _variationParameters;
+  std::vector<InputVariation> _variations;
+  std::vector<int> _statsVariationFoundJets;
+  int _variationThreads;
+
+  // MC particles clustered as ghosts, to find the truth particles and the flavour of each jet, see TruthGhosts.h
+  std::string _truthGhostCollectionName;
+  EVENT::IntVec _truthGhostGeneratorStatuses;
+  double _truthGhostScale;
+  TruthGhosts _truthGhosts;
+  long _statsTruthGhosts;
+  int _statsBJets;
+  int _statsCJets;
+
   FastJetUtil* _fju;
 
 private:
@@ -75,7 +75,9 @@ class FastJetTopTagger : marlin::Processor {
   int _statsNrSkippedEmptyEvents;
   int _statsNrSkippedFixedNrJets;
   int _statsNrSkippedMaxIterations;
+  int _statsNrBudgetFallbacks;
   bool _storeParticlesInJets;  
+  bool _sparseOutput;
 
   FastJetUtil* _fju;
 
@@ -87,14 +89,35 @@ class FastJetTopTagger : marlin::Processor {
   double _deltaP;
   double _deltaR;
   double _cos_theta_W_max;
+  EVENT::FloatVec _additionalWorkingPoints;
+
+  // one tagger per working point, the first one from deltaP, deltaR and cos_theta_W_max
+  std::vector<fastjet::JHTopTagger> _jhtoptaggers;
+  std::vector<double> _taggerDeltaP;
+  std::vector<double> _taggerDeltaR;
+  std::vector<double> _taggerCosThetaWMax;
+  std::vector<int> _statsTaggedJets;
+
+  // one step along the harder branch of a jet's declustering, pt1 >= pt2
+  struct Split {
+    double pt1;
+    double pt2;
+    double distance;
+  };
 
-  fastjet::JHTopTagger _jhtoptagger;
+  // the top tagger collections of one working point
+  struct TaggerOutput;
 
   FastJetTopTagger(const FastJetTopTagger& rhs) = delete;
   FastJetTopTagger & operator = (const FastJetTopTagger&) = delete;
   
   double getECF(fastjet::PseudoJet& jet, int whichECF, const std::string& energyCorr);
 
+  void findSplits(const fastjet::PseudoJet& jet, std::vector<Split>& splits) const;
+  bool splitsOnce(const std::vector<Split>& splits, double refPt, unsigned workingPoint) const;
+  std::string taggerOutputName(unsigned workingPoint) const;
+  void addTaggerOutput(LCEvent* evt, TaggerOutput& out, unsigned workingPoint) const;
+
   // Simple class to store Axes along with a name
   class AxesStruct {
   private:
@@ -20,6 +20,12 @@
  *   PseudoJetList convertFromRecParticle(LCCollection* recCol);
  *   ReconstructedParticle* convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, LCCollection recCol);
  *   PseudoJetList clusterJets(PseudoJetList& pjList, LCCollection* recCol);
+ * or, without exceptions for the skipped events,
+ *   void findJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, ClusteringResult& result);
+ * (with the truth ghosts of TruthGhosts.h at the end of pjList, pass their number as nGhosts)
+ *
+ * for the scan of the algorithm parameters (scanGrid) call initScan() in init, scanEvent() and
+ * writeScan() in processEvent and endScan() in end
  * 
  * If the processor is NOT in MarlinFastJet, add the following to CMakeLists.txt:
  * FIND_FILE( FJULOCATION "FastJetUtil.h" HINTS ENV{ILCSOFT}/MarlinFastJet )
@@ -28,7 +34,14 @@
  *
  */
 
+#include "ClusterSequenceCache.h"
+#include "Diagnostics.h"
 #include "EClusterMode.h"
+#include "GridMedianBackground.h"
+#include "JetColumnFile.h"
+#include "ScanResult.h"
+#include "TraceRecorder.h"
+#include "TruthGhosts.h"
 
 #include "LCIOSTLTypes.h"
 #include "marlin/Processor.h"
@@ -38,6 +51,7 @@
 #include <fastjet/CDFJetCluPlugin.hh>
 #include <fastjet/CDFMidPointPlugin.hh>
 #include <fastjet/ClusterSequence.hh>
+#include <fastjet/ClusterSequenceArea.hh>
 #include <fastjet/EECambridgePlugin.hh>
 #include <fastjet/JadePlugin.hh>
 #include <fastjet/NestedDefsPlugin.hh>
@@ -47,10 +61,24 @@
 
 #include <fastjet/contrib/ValenciaPlugin.hh>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define ITERATIVE_INCLUSIVE_MAX_ITERATIONS 20
+// with jet areas, every n-th event is also clustered without ghosts to measure the overhead
+#define AREA_TIMING_SAMPLE 100
 typedef std::vector< fastjet::PseudoJet > PseudoJetList;
 
 
@@ -66,6 +94,53 @@ public:
   PseudoJetList _jets;
 };
 
+/// the jets of one event as found by FastJetUtil::findJets, with the reason if the event was skipped
+struct ClusteringResult {
+  enum Status {
+    OK,
+    SKIPPED_FIXED_NR_JETS, ///< fewer particles (or jets that are not only truth ghosts) than requested jets
+    SKIPPED_MAX_ITERATIONS ///< the iterative mode did not converge, the jets of the last iteration
+  };
+
+  Status status{OK};
+  PseudoJetList jets{};
+  std::string skipReason{};
+  /// only for InclusiveIterativeNJets: the clusterings done and the R of the last one
+  int iterations{0};
+  double finalR{0.0};
+  /// the event went over the eventTimeBudget, the last iterations used the fallback settings
+  bool budgetFallback{false};
+};
+
+
+/// constituents of the jets of one collection as indices into the input collection,
+/// jet j has the constituents ConstituentIndices[ConstituentBegin[j]] up to ConstituentIndices[ConstituentBegin[j+1]-1]
+class ConstituentIndexList {
+
+public:
+  ConstituentIndexList(): _begin(1, 0), _indices() {}
+
+  void add(const PseudoJetList& constituents) {
+    for (unsigned n = 0; n < constituents.size(); ++n) {
+      _indices.push_back(constituents[n].user_index());
+    }
+    _begin.push_back(_indices.size());
+  }
+
+  const EVENT::IntVec& begin() const { return _begin; }
+  const EVENT::IntVec& indices() const { return _indices; }
+
+  void store(LCCollection* jetCol, const std::string& inputName) const {
+    jetCol->parameters().setValues(std::string("ConstituentBegin"), _begin);
+    jetCol->parameters().setValues(std::string("ConstituentIndices"), _indices);
+    jetCol->parameters().setValue(std::string("ConstituentCollection"), inputName);
+  }
+
+private:
+  EVENT::IntVec _begin;
+  EVENT::IntVec _indices;
+};
+
 
 class FastJetUtil {
 
@@ -84,7 +159,64 @@ public:
 		 _requestedNumberOfJets(0),
 		 _yCut(0.0),
 		 _minPt(0.0),
-		 _minE(0.0)
+		 _minE(0.0),
+		 _shareClusterSequence(false),
+		 _statsCacheHits(0),
+		 _statsCacheMisses(0),
+		 _inputMinE(0.0),
+		 _inputMinPt(0.0),
+		 _inputMaxAbsCosTheta(1.0),
+		 _inputChargeName("All"),
+		 _inputCharge(0),
+		 _inputExcludedTypes( EVENT::IntVec() ),
+		 _inputSelection(false),
+		 _statsInputParticles(0),
+		 _statsSelectedParticles(0),
+		 _softEnergyThreshold(0.0),
+		 _statsSoftParticles(0),
+		 _statsAttachedSoftParticles(0),
+		 _areaTypeName("None"),
+		 _areaGhostMaxRap(5.0),
+		 _areaGhostArea(0.01),
+		 _areaRepeat(1),
+		 _areaSeed(12345),
+		 _areaVoronoiRFact(1.0),
+		 _areaDefinition(NULL),
+		 _areaSeeds(),
+		 _statsClusterings(0),
+		 _statsClusteringTime(0.0),
+		 _statsAreaSamples(0),
+		 _statsAreaSampleTime(0.0),
+		 _statsAreaSamplePlainTime(0.0),
+		 _statsMutex(),
+		 _backgroundEstimation(false),
+		 _backgroundGridMaxRap(2.5),
+		 _backgroundGridSpacing(0.55),
+		 _subtractBackground(false),
+		 _statsRhoSum(0.0),
+		 _statsRhoEvents(0),
+		 _constituentIndices(false),
+		 _eventTimeBudget(0.0),
+		 _fallbackMaxIterations(5),
+		 _fallbackInputMinE(0.0),
+		 _fallbackStrategyName(""),
+		 _fallbackStrategy(),
+		 _diagnosticsMaxMessages(10),
+		 _diagnosticsSampleEvery(1000),
+		 _diagnosticsSummaryEvery(0),
+		 _diagnostics(),
+		 _traceFileName(""),
+		 _traceSampleEvery(1),
+		 _traceRecorder(),
+		 _scanGridParameters( EVENT::StringVec() ),
+		 _scanFileName(""),
+		 _scanThreads(0),
+		 _scanParameterNames(),
+		 _scanPoints(),
+		 _scanJetAlgos(),
+		 _scanColumns(),
+		 _statsScanJets(),
+		 _statsScanEvents(0)
   {}
 
 
@@ -103,7 +235,64 @@ public:
     _requestedNumberOfJets(rhs._requestedNumberOfJets),
     _yCut(rhs._yCut),
     _minPt(rhs._minPt),
-    _minE(rhs._minE)
+    _minE(rhs._minE),
+    _shareClusterSequence(rhs._shareClusterSequence),
+    _statsCacheHits(rhs._statsCacheHits),
+    _statsCacheMisses(rhs._statsCacheMisses),
+    _inputMinE(rhs._inputMinE),
+    _inputMinPt(rhs._inputMinPt),
+    _inputMaxAbsCosTheta(rhs._inputMaxAbsCosTheta),
+    _inputChargeName(rhs._inputChargeName),
+    _inputCharge(rhs._inputCharge),
+    _inputExcludedTypes(rhs._inputExcludedTypes),
+    _inputSelection(rhs._inputSelection),
+    _statsInputParticles(rhs._statsInputParticles),
+    _statsSelectedParticles(rhs._statsSelectedParticles),
+    _softEnergyThreshold(rhs._softEnergyThreshold),
+    _statsSoftParticles(rhs._statsSoftParticles),
+    _statsAttachedSoftParticles(rhs._statsAttachedSoftParticles),
+    _areaTypeName(rhs._areaTypeName),
+    _areaGhostMaxRap(rhs._areaGhostMaxRap),
+    _areaGhostArea(rhs._areaGhostArea),
+    _areaRepeat(rhs._areaRepeat),
+    _areaSeed(rhs._areaSeed),
+    _areaVoronoiRFact(rhs._areaVoronoiRFact),
+    _areaDefinition(rhs._areaDefinition ? new fastjet::AreaDefinition(*rhs._areaDefinition) : NULL),
+    _areaSeeds(rhs._areaSeeds),
+    _statsClusterings(rhs._statsClusterings),
+    _statsClusteringTime(rhs._statsClusteringTime),
+    _statsAreaSamples(rhs._statsAreaSamples),
+    _statsAreaSampleTime(rhs._statsAreaSampleTime),
+    _statsAreaSamplePlainTime(rhs._statsAreaSamplePlainTime),
+    _statsMutex(),
+    _backgroundEstimation(rhs._backgroundEstimation),
+    _backgroundGridMaxRap(rhs._backgroundGridMaxRap),
+    _backgroundGridSpacing(rhs._backgroundGridSpacing),
+    _subtractBackground(rhs._subtractBackground),
+    _statsRhoSum(rhs._statsRhoSum),
+    _statsRhoEvents(rhs._statsRhoEvents),
+    _constituentIndices(rhs._constituentIndices),
+    _eventTimeBudget(rhs._eventTimeBudget),
+    _fallbackMaxIterations(rhs._fallbackMaxIterations),
+    _fallbackInputMinE(rhs._fallbackInputMinE),
+    _fallbackStrategyName(rhs._fallbackStrategyName),
+    _fallbackStrategy(rhs._fallbackStrategy),
+    _diagnosticsMaxMessages(rhs._diagnosticsMaxMessages),
+    _diagnosticsSampleEvery(rhs._diagnosticsSampleEvery),
+    _diagnosticsSummaryEvery(rhs._diagnosticsSummaryEvery),
+    _diagnostics(rhs._diagnostics),
+    _traceFileName(rhs._traceFileName),
+    _traceSampleEvery(rhs._traceSampleEvery),
+    _traceRecorder(rhs._traceRecorder),
+    _scanGridParameters(rhs._scanGridParameters),
+    _scanFileName(rhs._scanFileName),
+    _scanThreads(rhs._scanThreads),
+    _scanParameterNames(rhs._scanParameterNames),
+    _scanPoints(rhs._scanPoints),
+    _scanJetAlgos(rhs._scanJetAlgos),
+    _scanColumns(rhs._scanColumns),
+    _statsScanJets(rhs._statsScanJets),
+    _statsScanEvents(rhs._statsScanEvents)
   {}
 
   FastJetUtil& operator=(const FastJetUtil& rhs) {
@@ -112,12 +301,85 @@ public:
     }
     delete this->_jetAlgo;
     this->_jetAlgo = new fastjet::JetDefinition(*rhs._jetAlgo);
+    delete this->_areaDefinition;
+    this->_areaDefinition = rhs._areaDefinition ? new fastjet::AreaDefinition(*rhs._areaDefinition) : NULL;
+    // everything else like in the copy constructor, each object keeps its own _statsMutex
+    _jetAlgoNameAndParams = rhs._jetAlgoNameAndParams;
+    _jetAlgoName = rhs._jetAlgoName;
+    _jetAlgoType = rhs._jetAlgoType;
+    _clusterModeNameAndParam = rhs._clusterModeNameAndParam;
+    _clusterModeName = rhs._clusterModeName;
+    _clusterMode = rhs._clusterMode;
+    _jetRecoSchemeName = rhs._jetRecoSchemeName;
+    _jetRecoScheme = rhs._jetRecoScheme;
+    _strategyName = rhs._strategyName;
+    _strategy = rhs._strategy;
+    _requestedNumberOfJets = rhs._requestedNumberOfJets;
+    _yCut = rhs._yCut;
+    _minPt = rhs._minPt;
+    _minE = rhs._minE;
+    _shareClusterSequence = rhs._shareClusterSequence;
+    _statsCacheHits = rhs._statsCacheHits;
+    _statsCacheMisses = rhs._statsCacheMisses;
+    _inputMinE = rhs._inputMinE;
+    _inputMinPt = rhs._inputMinPt;
+    _inputMaxAbsCosTheta = rhs._inputMaxAbsCosTheta;
+    _inputChargeName = rhs._inputChargeName;
+    _inputCharge = rhs._inputCharge;
+    _inputExcludedTypes = rhs._inputExcludedTypes;
+    _inputSelection = rhs._inputSelection;
+    _statsInputParticles = rhs._statsInputParticles;
+    _statsSelectedParticles = rhs._statsSelectedParticles;
+    _softEnergyThreshold = rhs._softEnergyThreshold;
+    _statsSoftParticles = rhs._statsSoftParticles;
+    _statsAttachedSoftParticles = rhs._statsAttachedSoftParticles;
+    _areaTypeName = rhs._areaTypeName;
+    _areaGhostMaxRap = rhs._areaGhostMaxRap;
+    _areaGhostArea = rhs._areaGhostArea;
+    _areaRepeat = rhs._areaRepeat;
+    _areaSeed = rhs._areaSeed;
+    _areaVoronoiRFact = rhs._areaVoronoiRFact;
+    _areaSeeds = rhs._areaSeeds;
+    _statsClusterings = rhs._statsClusterings;
+    _statsClusteringTime = rhs._statsClusteringTime;
+    _statsAreaSamples = rhs._statsAreaSamples;
+    _statsAreaSampleTime = rhs._statsAreaSampleTime;
+    _statsAreaSamplePlainTime = rhs._statsAreaSamplePlainTime;
+    _backgroundEstimation = rhs._backgroundEstimation;
+    _backgroundGridMaxRap = rhs._backgroundGridMaxRap;
+    _backgroundGridSpacing = rhs._backgroundGridSpacing;
+    _subtractBackground = rhs._subtractBackground;
+    _statsRhoSum = rhs._statsRhoSum;
+    _statsRhoEvents = rhs._statsRhoEvents;
+    _constituentIndices = rhs._constituentIndices;
+    _eventTimeBudget = rhs._eventTimeBudget;
+    _fallbackMaxIterations = rhs._fallbackMaxIterations;
+    _fallbackInputMinE = rhs._fallbackInputMinE;
+    _fallbackStrategyName = rhs._fallbackStrategyName;
+    _fallbackStrategy = rhs._fallbackStrategy;
+    _diagnosticsMaxMessages = rhs._diagnosticsMaxMessages;
+    _diagnosticsSampleEvery = rhs._diagnosticsSampleEvery;
+    _diagnosticsSummaryEvery = rhs._diagnosticsSummaryEvery;
+    _diagnostics = rhs._diagnostics;
+    _traceFileName = rhs._traceFileName;
+    _traceSampleEvery = rhs._traceSampleEvery;
+    _traceRecorder = rhs._traceRecorder;
+    _scanGridParameters = rhs._scanGridParameters;
+    _scanFileName = rhs._scanFileName;
+    _scanThreads = rhs._scanThreads;
+    _scanParameterNames = rhs._scanParameterNames;
+    _scanPoints = rhs._scanPoints;
+    _scanJetAlgos = rhs._scanJetAlgos;
+    _scanColumns = rhs._scanColumns;
+    _statsScanJets = rhs._statsScanJets;
+    _statsScanEvents = rhs._statsScanEvents;
     return *this;
   }
 
 
   ~FastJetUtil() {
     delete _jetAlgo;
+    delete _areaDefinition;
   }
 
 public:
@@ -147,18 +409,144 @@ public:
   double _minPt;
   double _minE;
 
+  // reuse the clustering of other processors with the same configuration in the same event
+  bool _shareClusterSequence;
+  int _statsCacheHits;
+  int _statsCacheMisses;
+
+  // selection of the input particles before the clustering
+  double _inputMinE;
+  double _inputMinPt;
+  double _inputMaxAbsCosTheta;
+  std::string _inputChargeName;
+  int _inputCharge; // 0: all, 1: charged, 2: neutral
+  EVENT::IntVec _inputExcludedTypes;
+  bool _inputSelection;
+  long _statsInputParticles;
+  long _statsSelectedParticles;
+
+  // particles below this energy are not clustered but attached to the closest jet afterwards
+  double _softEnergyThreshold;
+  long _statsSoftParticles;
+  long _statsAttachedSoftParticles;
+
+  // jet areas, the ghosts are defined once per job and every event gets the same ghosts
+  std::string _areaTypeName;
+  double _areaGhostMaxRap;
+  double _areaGhostArea;
+  int _areaRepeat;
+  int _areaSeed;
+  double _areaVoronoiRFact;
+  fastjet::AreaDefinition* _areaDefinition;
+  std::vector<int> _areaSeeds;
+
+  // timing of the clustering, the variations are clustered on several threads
+  long _statsClusterings;
+  double _statsClusteringTime;
+  long _statsAreaSamples;
+  double _statsAreaSampleTime;
+  double _statsAreaSamplePlainTime;
+  std::mutex _statsMutex;
+
+  // grid-median estimate of the background density, optionally subtracted from the jets
+  bool _backgroundEstimation;
+  double _backgroundGridMaxRap;
+  double _backgroundGridSpacing;
+  bool _subtractBackground;
+  double _statsRhoSum;
+  long _statsRhoEvents;
+
+  // store the constituents as indices into the input collection instead of adding the particles to the jets
+  bool _constituentIndices;
+
+  // CPU time one event may spend in the iterations of InclusiveIterativeNJets, after that the remaining
+  // iterations use the cheaper fallback settings. Checked between the iterations only, the other modes have no budget
+  double _eventTimeBudget;
+  int _fallbackMaxIterations;
+  double _fallbackInputMinE;
+  std::string _fallbackStrategyName;
+  fastjet::Strategy _fallbackStrategy;
+
+  // the per-event warnings, counted by reason and only written now and then
+  int _diagnosticsMaxMessages;
+  int _diagnosticsSampleEvery;
+  int _diagnosticsSummaryEvery;
+  Diagnostics _diagnostics;
+
+  // timed spans of every n-th event for a trace viewer, shared with the other processors writing the same file
+  std::string _traceFileName;
+  int _traceSampleEvery;
+  TraceRecorder::Ptr _traceRecorder;
+
+  // scan of the algorithm parameters, every event is clustered again for each point of the grid
+  EVENT::StringVec _scanGridParameters;
+  std::string _scanFileName;
+  int _scanThreads;
+  std::vector<std::string> _scanParameterNames;
+  std::vector<std::vector<double> > _scanPoints;
+  std::vector<std::shared_ptr<fastjet::JetDefinition> > _scanJetAlgos;
+  std::shared_ptr<JetColumnWriter> _scanColumns;
+  std::vector<long> _statsScanJets;
+  long _statsScanEvents;
+
 public:
   /// call in processor constructor (c'tor) to register parameters
   template< class T>
   inline void registerFastJetParameters(T* proc);
   /// call in processor init
   inline void init();
-  /// convert reconstructed particles to pseudo jets
-  inline PseudoJetList convertFromRecParticle(LCCollection* recCol);
-  /// convert fastjet pseudojet to reconstructed particle
-  inline EVENT::ReconstructedParticle* convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, LCCollection* reconstructedPars);
-  /// does the actual clustering
-  inline PseudoJetList clusterJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, LCCollection* reconstructedPars);
+  /// convert reconstructed particles to pseudo jets, filling the background grid and the particle table on the way if given
+  inline PseudoJetList convertFromRecParticle(LCCollection* recCol, GridMedianBackground* background = NULL, ParticleTable* particles = NULL);
+  /// everything that determines the clustering of the input collection, the same key means the same clustering
+  inline std::string clusteringKey(const std::string& collectionName) const;
+  /// convert and cluster the input collection, or take the clustering from the cache if another processor did it already
+  inline ClusterSequenceCache::EntryPtr getClusterSequence(LCEvent* evt, const std::string& collectionName, LCCollection* recCol);
+  /// cluster the particles, with jet areas if requested
+  inline std::shared_ptr<fastjet::ClusterSequence> makeClusterSequence(const PseudoJetList& pjList);
+  /// store area and area error of each jet in the collection parameters JetArea and JetAreaError
+  inline void storeJetAreas(const PseudoJetList& jets, const fastjet::ClusterSequence& cs, LCCollection* jetCol);
+  /// store rho and sigma of the event in the collection parameters
+  inline void storeBackground(const ClusterSequenceCache::Entry& entry, LCCollection* jetCol);
+  /// subtract rho times the area of clusteredJet from jet, the jet is zero if the background is larger
+  inline void subtractBackground(fastjet::PseudoJet& jet, const fastjet::PseudoJet& clusteredJet, const fastjet::ClusterSequence& cs, double rho);
+  /// print the clustering time and the overhead of the jet areas
+  inline void printTimingSummary();
+  /// the recorder for the spans of this event, NULL if it is not traced
+  inline TraceRecorder* traceRecorder(const LCEvent* evt) const;
+  /// the statistics as "name value" lines, they can be added up over several jobs
+  inline void writeStatistics(std::ostream& out) const;
+  /// convert the input collection and split off the soft particles
+  inline void convertInput(LCCollection* recCol, ClusterSequenceCache::Entry& entry);
+  /// attach each soft particle to the closest jet, softConstituents has one list per jet
+  inline void attachSoftParticles(const PseudoJetList& jets, const PseudoJetList& softList, std::vector<PseudoJetList>& softConstituents);
+  /// convert fastjet pseudojet to reconstructed particle, with constituentIndices the constituents go to indexList
+  inline EVENT::ReconstructedParticle* convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, LCCollection* reconstructedPars,
+							    ConstituentIndexList* indexList = NULL);
+  /// same, but the constituents are looked up in the particle table of the event
+  inline EVENT::ReconstructedParticle* convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, const ParticleTable& particles,
+							    ConstituentIndexList* indexList = NULL);
+  /// does the actual clustering, skipped events are reported in the result instead of by exceptions.
+  /// The last nGhosts of pjList are truth ghosts: they do not count as particles, and jets of
+  /// nothing but ghosts are dropped. The InclusiveIterativeNJets mode cannot take ghosts
+  inline void findJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, ClusteringResult& result, unsigned nGhosts = 0);
+  /// the same, but skipped events throw SkippedFixedNrJetException or SkippedMaxIterationException,
+  /// fallback is set if the event went over the time budget
+  inline PseudoJetList clusterJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, LCCollection* reconstructedPars, bool* fallback = NULL);
+  /// parse the scanGrid and create the scanFile, nothing to do without a scanGrid
+  inline void initScan();
+  /// cluster the particles and find the jets for every point of the scanGrid, on scanThreads threads
+  inline void scanEvent(PseudoJetList& pjList, std::vector<ScanResult>& results);
+  /// add the results of one event to the scanFile, in the order of the events
+  inline void writeScan(int run, int event, const std::vector<ScanResult>& results);
+  /// write the scanFile and the summary of each point
+  inline void endScan();
+  /// the workers of MarlinFastJetShards each write their own files
+  static inline std::string shardFileName(const std::string& fileName);
+
+  /// writes a warning (or debug message) to streamlog, or keeps it if a Diagnostics::Capture is active on this thread
+  static inline void logMessage(bool warning, const std::string& message);
+  /// writes the messages kept by the worker threads of an event, to be called on the processor thread
+  static inline void writeMessages(const std::vector<Diagnostics::Message>& messages);
 
 protected:
   // helper functions to init the jet algorithms in general
@@ -166,10 +554,26 @@ protected:
   inline void initRecoScheme();
   inline void initStrategy();
   inline void initClusterMode();
+  inline void initInputSelection();
+  inline void initJetArea();
+  inline void initBackground();
+  inline void initTimeBudget();
+  inline void initTrace();
   inline bool isJetAlgo(std::string algo, int nrParams, int supportedModes);
+  /// the selected algorithm with other values of its parameters, for the scan
+  inline fastjet::JetDefinition* makeJetAlgo(const std::vector<double>& params) const;
+
+  // the jet particle without constituents
+  inline IMPL::ReconstructedParticleImpl* newJetParticle(const fastjet::PseudoJet& jet);
 
   // special clustering function, called from clusterJets
-  inline PseudoJetList doIterativeInclusiveClustering(PseudoJetList& pjList);
+  inline void doIterativeInclusiveClustering(PseudoJetList& pjList, ClusteringResult& result);
+
+  // true if all constituents of the jet are truth ghosts
+  static inline bool onlyGhosts(const fastjet::ClusterSequence& cs, const fastjet::PseudoJet& jet);
+
+  // CPU time of the calling thread in seconds
+  static inline double threadCpuTime();
 
 }; //end class FastJetUtil
 
@@ -201,6 +605,179 @@ void FastJetUtil::registerFastJetParameters( T* proc ) {
 				   _clusterModeNameAndParam,
 				   defClusterMode);
 
+  proc->registerProcessorParameter(
+				   "shareClusterSequence",
+				   "Share the converted input and the ClusterSequence with other processors that cluster the same input collection with the same algorithm and recombination scheme in the same event",
+				   _shareClusterSequence,
+				   false);
+
+  proc->registerProcessorParameter(
+				   "inputMinE",
+				   "Only particles with at least this energy are used for the clustering",
+				   _inputMinE,
+				   double(0.0));
+
+  proc->registerProcessorParameter(
+				   "inputMinPt",
+				   "Only particles with at least this transverse momentum are used for the clustering",
+				   _inputMinPt,
+				   double(0.0));
+
+  proc->registerProcessorParameter(
+				   "inputMaxAbsCosTheta",
+				   "Only particles with |cos(theta)| up to this value are used for the clustering",
+				   _inputMaxAbsCosTheta,
+				   double(1.0));
+
+  proc->registerProcessorParameter(
+				   "inputCharge",
+				   "Which particles are used for the clustering: 'All', 'Charged' or 'Neutral'",
+				   _inputChargeName,
+				   std::string("All"));
+
+  proc->registerProcessorParameter(
+				   "inputExcludedTypes",
+				   "Particles with any of these |type| (PDG) values are not used for the clustering",
+				   _inputExcludedTypes,
+				   EVENT::IntVec());
+
+  proc->registerProcessorParameter(
+				   "jetAreaType",
+				   "Calculate the jet areas: 'None', 'Active', 'Passive' or 'Voronoi'",
+				   _areaTypeName,
+				   std::string("None"));
+
+  proc->registerProcessorParameter(
+				   "jetAreaGhostMaxRap",
+				   "Ghosts for the active and passive areas are placed up to this rapidity",
+				   _areaGhostMaxRap,
+				   double(5.0));
+
+  proc->registerProcessorParameter(
+				   "jetAreaGhostArea",
+				   "Area in (y,phi) of a single ghost for the active and passive areas",
+				   _areaGhostArea,
+				   double(0.01));
+
+  proc->registerProcessorParameter(
+				   "jetAreaRepeat",
+				   "Number of ghost sets the active area is averaged over",
+				   _areaRepeat,
+				   int(1));
+
+  proc->registerProcessorParameter(
+				   "jetAreaSeed",
+				   "Seed of the ghost positions, all events use the same ghosts",
+				   _areaSeed,
+				   int(12345));
+
+  proc->registerProcessorParameter(
+				   "jetAreaVoronoiRFact",
+				   "Fraction of R the Voronoi cells of the particles are limited to",
+				   _areaVoronoiRFact,
+				   double(1.0));
+
+  proc->registerProcessorParameter(
+				   "backgroundEstimation",
+				   "Estimate the background density rho and its fluctuation sigma from the input particles (grid median), stored in the jet collection parameters",
+				   _backgroundEstimation,
+				   false);
+
+  proc->registerProcessorParameter(
+				   "backgroundGridMaxRap",
+				   "The grid for the background estimation covers |y| up to this value",
+				   _backgroundGridMaxRap,
+				   double(2.5));
+
+  proc->registerProcessorParameter(
+				   "backgroundGridSpacing",
+				   "Size of the grid cells for the background estimation in y and phi",
+				   _backgroundGridSpacing,
+				   double(0.55));
+
+  proc->registerProcessorParameter(
+				   "subtractBackground",
+				   "Subtract rho times the jet area from the jet four-vectors. Needs backgroundEstimation and a jetAreaType",
+				   _subtractBackground,
+				   false);
+
+  proc->registerProcessorParameter(
+				   "constituentIndices",
+				   "Do not add the constituent particles to the jets, store their indices into the input collection in the jet collection parameters ConstituentBegin and ConstituentIndices instead",
+				   _constituentIndices,
+				   false);
+
+  proc->registerProcessorParameter(
+				   "eventTimeBudget",
+				   "CPU time in seconds the iterations of the InclusiveIterativeNJets mode may take for one event. The remaining iterations use the fallback settings (fallbackMaxIterations, fallbackInputMinE, fallbackStrategy) and the jet collection gets the parameter TimeBudgetFallback. The budget is only checked between two iterations, a clustering that has started is not interrupted, so one event can still go over it by the time of one clustering. The other cluster modes cluster once and are not limited. 0 for no budget",
+				   _eventTimeBudget,
+				   double(0.0));
+
+  proc->registerProcessorParameter(
+				   "fallbackMaxIterations",
+				   "Number of iterations left to an event once it is over the eventTimeBudget",
+				   _fallbackMaxIterations,
+				   int(5));
+
+  proc->registerProcessorParameter(
+				   "fallbackInputMinE",
+				   "Once an event is over the eventTimeBudget, the remaining iterations only cluster the particles with at least this energy. 0 to keep all particles",
+				   _fallbackInputMinE,
+				   double(0.0));
+
+  proc->registerProcessorParameter(
+				   "fallbackStrategy",
+				   "FastJet clustering strategy for the iterations after the eventTimeBudget: N2Plain, N2Tiled, N2MinHeapTiled, NlnN, NlnNCam or Best. If no value specified the strategy is not changed",
+				   _fallbackStrategyName,
+				   std::string(""));
+
+  proc->registerProcessorParameter(
+				   "diagnosticsMaxMessages",
+				   "Number of per-event warnings (empty input, skipped events, ...) written for each reason, after that they are only counted and sampled",
+				   _diagnosticsMaxMessages,
+				   int(10));
+
+  proc->registerProcessorParameter(
+				   "diagnosticsSampleEvery",
+				   "After diagnosticsMaxMessages, write only every n-th warning of each reason. 0 to write none",
+				   _diagnosticsSampleEvery,
+				   int(1000));
+
+  proc->registerProcessorParameter(
+				   "diagnosticsSummaryEvery",
+				   "Write the counts of all warnings every n events. 0 for a summary at the end only",
+				   _diagnosticsSummaryEvery,
+				   int(0));
+
+  proc->registerProcessorParameter(
+				   "traceFile",
+				   "File to write the times of the conversion, clustering, jet finding and output of single events to, in the trace event format of chrome://tracing and Perfetto. Processors with the same file write to it together, the workers of MarlinFastJetShards each to the file name with .shard<n> appended. If no value specified no trace is written",
+				   _traceFileName,
+				   std::string(""));
+
+  proc->registerProcessorParameter(
+				   "traceSampleEvery",
+				   "Trace only the events whose event number is a multiple of this",
+				   _traceSampleEvery,
+				   int(1));
+
+  proc->registerProcessorParameter(
+				   "scanGrid",
+				   "Cluster every event also for each point of a grid of algorithm parameters, given as the name of a parameter followed by its values, e.g. 'R 0.5 1.0 1.5 p 0.5 1'. The names are R and p for genkt_algorithm and ee_genkt_algorithm, R, beta and gamma for ValenciaPlugin. Parameters not given keep the value of the algorithm. Only FastJetProcessor runs the scan. If no value specified there is no scan",
+				   _scanGridParameters,
+				   EVENT::StringVec());
+
+  proc->registerProcessorParameter(
+				   "scanFile",
+				   "File for the jets of the scanGrid, in the format of the jetColumnFile with one entry per event and grid point (see JetColumnFile.h). The grid points are listed in <scanFile>.points",
+				   _scanFileName,
+				   std::string(""));
+
+  proc->registerProcessorParameter(
+				   "scanThreads",
+				   "Number of threads clustering the grid points of an event in parallel, 0 for one per core",
+				   _scanThreads,
+				   int(0));
 
 }
 
@@ -210,6 +787,12 @@ void FastJetUtil::init() {
   initRecoScheme();
   initClusterMode();
   initJetAlgo();
+  initInputSelection();
+  initJetArea();
+  initBackground();
+  initTimeBudget();
+  _diagnostics.configure(_diagnosticsMaxMessages, _diagnosticsSampleEvery, _diagnosticsSummaryEvery);
+  initTrace();
 
 }
 
@@ -414,6 +997,379 @@ void FastJetUtil::initRecoScheme() {
   streamlog_out(MESSAGE) << "recombination scheme: " << _jetRecoSchemeName << std::endl;
 }
 
+/// check the selection of the input particles
+void FastJetUtil::initInputSelection() {
+
+  if (_inputChargeName.compare("All") == 0)
+    _inputCharge = 0;
+  else if (_inputChargeName.compare("Charged") == 0)
+    _inputCharge = 1;
+  else if (_inputChargeName.compare("Neutral") == 0)
+    _inputCharge = 2;
+  else {
+    streamlog_out(ERROR) << "Unknown inputCharge: " << _inputChargeName << std::endl;
+    throw Exception("Unknown inputCharge selection! Expected 'All', 'Charged' or 'Neutral'.");
+  }
+
+  _inputSelection = _inputMinE > 0 || _inputMinPt > 0 || _inputMaxAbsCosTheta < 1.0 || _inputCharge != 0 || !_inputExcludedTypes.empty();
+
+  if (_inputSelection) {
+    streamlog_out(MESSAGE) << "Input selection: E >= " << _inputMinE
+			   << ", pt >= " << _inputMinPt
+			   << ", |cos(theta)| <= " << _inputMaxAbsCosTheta
+			   << ", charge: " << _inputChargeName
+			   << ", excluded types: " << _inputExcludedTypes.size() << std::endl;
+  }
+}
+
+/// set up the area definition and the ghosts
+void FastJetUtil::initJetArea() {
+
+  delete _areaDefinition;
+  _areaDefinition = NULL;
+
+  if (_areaTypeName.compare("None") == 0) {
+    return;
+  }
+
+  // the iterations cluster again with other R, the areas would be looked up in the wrong clustering
+  if (_clusterMode == OWN_inclusiveIteration) {
+    throw Exception("jetAreaType cannot be combined with InclusiveIterativeNJets, the jets of the iterations have no areas");
+  }
+
+  const fastjet::GhostedAreaSpec ghostSpec(_areaGhostMaxRap, _areaRepeat, _areaGhostArea);
+  if (_areaTypeName.compare("Active") == 0)
+    _areaDefinition = new fastjet::AreaDefinition(fastjet::active_area, ghostSpec);
+  else if (_areaTypeName.compare("Passive") == 0)
+    _areaDefinition = new fastjet::AreaDefinition(fastjet::passive_area, ghostSpec);
+  else if (_areaTypeName.compare("Voronoi") == 0)
+    _areaDefinition = new fastjet::AreaDefinition(fastjet::voronoi_area, fastjet::VoronoiAreaSpec(_areaVoronoiRFact));
+  else {
+    streamlog_out(ERROR) << "Unknown jetAreaType: " << _areaTypeName << std::endl;
+    throw Exception("Unknown jet area type! Expected 'None', 'Active', 'Passive' or 'Voronoi'.");
+  }
+
+  // the random generator is reset to this state for every event, so the ghosts are the same in all events
+  _areaDefinition->ghost_spec().get_random_status(_areaSeeds);
+  for (unsigned i = 0; i < _areaSeeds.size(); ++i) {
+    _areaSeeds[i] = _areaSeed + i;
+  }
+
+  streamlog_out(MESSAGE) << "Jet areas: " << _areaDefinition->description() << std::endl;
+}
+
+void FastJetUtil::initTimeBudget() {
+
+  if (_eventTimeBudget <= 0) {
+    return;
+  }
+
+  if (_clusterMode != OWN_inclusiveIteration) {
+    streamlog_out(WARNING) << "eventTimeBudget only applies to the InclusiveIterativeNJets mode, the other modes cluster once and have no time limit" << std::endl;
+  }
+  if (_fallbackMaxIterations < 0) {
+    throw Exception("fallbackMaxIterations has to be 0 or more");
+  }
+
+  if (_fallbackStrategyName.empty()) _fallbackStrategy = _strategy;
+  else if (_fallbackStrategyName == "N2Plain") _fallbackStrategy = fastjet::N2Plain;
+  else if (_fallbackStrategyName == "N2Tiled") _fallbackStrategy = fastjet::N2Tiled;
+  else if (_fallbackStrategyName == "N2MinHeapTiled") _fallbackStrategy = fastjet::N2MinHeapTiled;
+  else if (_fallbackStrategyName == "NlnN") _fallbackStrategy = fastjet::NlnN;
+  else if (_fallbackStrategyName == "NlnNCam") _fallbackStrategy = fastjet::NlnNCam;
+  else if (_fallbackStrategyName == "Best") _fallbackStrategy = fastjet::Best;
+  else throw Exception("Unknown fallbackStrategy: " + _fallbackStrategyName);
+
+  streamlog_out(MESSAGE) << "Event time budget: " << _eventTimeBudget << " s, then at most " << _fallbackMaxIterations << " more iterations"
+			 << (_fallbackInputMinE > 0 ? " with the particles above the fallbackInputMinE" : "")
+			 << (_fallbackStrategyName.empty() ? "" : " with strategy " + _fallbackStrategyName) << std::endl;
+}
+
+void FastJetUtil::initTrace() {
+
+  _traceRecorder.reset();
+  if (_traceFileName.empty()) {
+    return;
+  }
+  if (_traceSampleEvery < 1) {
+    throw Exception("traceSampleEvery has to be 1 or more");
+  }
+
+  // each worker of a sharded job writes its own trace
+  const std::string fileName = shardFileName(_traceFileName);
+  _traceRecorder = TraceRecorder::open(fileName);
+  if (!_traceRecorder) {
+    throw Exception("Cannot open the trace file " + fileName);
+  }
+  streamlog_out(MESSAGE) << "Trace of every " << _traceSampleEvery << ". event written to " << fileName << std::endl;
+}
+
+TraceRecorder* FastJetUtil::traceRecorder(const LCEvent* evt) const {
+  if (!_traceRecorder || evt->getEventNumber() % _traceSampleEvery != 0) return NULL;
+  return _traceRecorder.get();
+}
+
+std::string FastJetUtil::shardFileName(const std::string& fileName) {
+  const char* shard = getenv("MARLINFASTJET_SHARD");
+  return shard ? fileName + ".shard" + shard : fileName;
+}
+
+void FastJetUtil::logMessage(bool warning, const std::string& message) {
+  if (std::vector<Diagnostics::Message>* messages = Diagnostics::Capture::messages()) {
+    Diagnostics::Message kept = {warning, message};
+    messages->push_back(kept);
+  } else if (warning) {
+    streamlog_out(WARNING) << message << std::endl;
+  } else {
+    streamlog_out(DEBUG) << message << std::endl;
+  }
+}
+
+void FastJetUtil::writeMessages(const std::vector<Diagnostics::Message>& messages) {
+  for (unsigned i = 0; i < messages.size(); ++i) {
+    logMessage(messages[i].warning, messages[i].text);
+  }
+}
+
+/// parse the grid of the parameter scan
+void FastJetUtil::initScan() {
+
+  _scanParameterNames.clear();
+  _scanPoints.clear();
+  _scanJetAlgos.clear();
+  _scanColumns.reset();
+  _statsScanJets.clear();
+  _statsScanEvents = 0;
+
+  if (_scanGridParameters.empty()) {
+    return;
+  }
+  if (_scanFileName.empty()) {
+    throw Exception("scanGrid needs a scanFile for the jets");
+  }
+  if (_clusterMode == OWN_inclusiveIteration) {
+    throw Exception("scanGrid is not available for InclusiveIterativeNJets, the iterations choose R themselves");
+  }
+
+  // the parameters in the order of the algorithm parameters
+  if (_jetAlgoName == "genkt_algorithm" || _jetAlgoName == "ee_genkt_algorithm") {
+    _scanParameterNames.push_back("R");
+    _scanParameterNames.push_back("p");
+  } else if (_jetAlgoName == "ValenciaPlugin") {
+    _scanParameterNames.push_back("R");
+    _scanParameterNames.push_back("beta");
+    _scanParameterNames.push_back("gamma");
+  } else {
+    throw Exception("scanGrid is only available for genkt_algorithm, ee_genkt_algorithm and ValenciaPlugin");
+  }
+
+  // the values of each parameter, the one of the algorithm if it is not scanned
+  const unsigned nParams = _scanParameterNames.size();
+  std::vector<std::vector<double> > values(nParams);
+  std::vector<bool> scanned(nParams, false);
+  for (unsigned i = 0; i < nParams; ++i) {
+    values[i].push_back(atof(_jetAlgoNameAndParams[i+1].c_str()));
+  }
+  int current = -1;
+  for (unsigned t = 0; t < _scanGridParameters.size(); ++t) {
+    const std::string& token = _scanGridParameters[t];
+    const unsigned name = std::find(_scanParameterNames.begin(), _scanParameterNames.end(), token) - _scanParameterNames.begin();
+    char* end = NULL;
+    const double value = strtod(token.c_str(), &end);
+    if (name < nParams) {
+      if (scanned[name]) {
+	throw Exception("scanGrid: the parameter " + token + " is given twice");
+      }
+      scanned[name] = true;
+      values[name].clear();
+      current = name;
+    } else if (current >= 0 && end != token.c_str() && *end == '\0') {
+      values[current].push_back(value);
+    } else {
+      throw Exception("scanGrid: " + token + " is neither a value nor a parameter of " + _jetAlgoName);
+    }
+  }
+  for (unsigned i = 0; i < nParams; ++i) {
+    if (values[i].empty()) {
+      throw Exception("scanGrid: no values for the parameter " + _scanParameterNames[i]);
+    }
+  }
+
+  // all combinations, the last parameter changes fastest
+  std::vector<unsigned> position(nParams, 0);
+  int i = 0;
+  do {
+    std::vector<double> point(nParams);
+    for (unsigned p = 0; p < nParams; ++p) {
+      point[p] = values[p][position[p]];
+    }
+    _scanPoints.push_back(point);
+    _scanJetAlgos.push_back(std::shared_ptr<fastjet::JetDefinition>(makeJetAlgo(point)));
+
+    for (i = nParams - 1; i >= 0 && ++position[i] == values[i].size(); --i) {
+      position[i] = 0;
+    }
+  } while (i >= 0);
+  _statsScanJets.assign(_scanPoints.size(), 0);
+
+  const std::string fileName = shardFileName(_scanFileName);
+  _scanColumns = std::make_shared<JetColumnWriter>();
+  if (!_scanColumns->open(fileName)) {
+    throw Exception("Cannot create the temporary files of the scan file " + fileName);
+  }
+
+  streamlog_out(MESSAGE) << "Scan of " << _scanPoints.size() << " grid points from " << _scanJetAlgos.front()->description()
+			 << " to " << _scanJetAlgos.back()->description() << std::endl;
+}
+
+fastjet::JetDefinition* FastJetUtil::makeJetAlgo(const std::vector<double>& params) const {
+
+  fastjet::JetDefinition* jetAlgo = NULL;
+  if (_jetAlgoName == "genkt_algorithm") {
+    jetAlgo = new fastjet::JetDefinition(fastjet::genkt_algorithm, params[0], params[1], _jetRecoScheme, _strategy);
+  } else if (_jetAlgoName == "ee_genkt_algorithm") {
+    jetAlgo = new fastjet::JetDefinition(fastjet::ee_genkt_algorithm, params[0], params[1], _jetRecoScheme, _strategy);
+  } else if (_jetAlgoName == "ValenciaPlugin") {
+    jetAlgo = new fastjet::JetDefinition(new fastjet::contrib::ValenciaPlugin(params[0], params[1], params[2]));
+    jetAlgo->delete_plugin_when_unused();
+  }
+  return jetAlgo;
+}
+
+void FastJetUtil::scanEvent(PseudoJetList& pjList, std::vector<ScanResult>& results) {
+
+  TraceRecorder::Span span("scan", "clustering");
+  if (span.active()) span.arg("points", _scanPoints.size()).arg("particles", pjList.size());
+
+  results.assign(_scanPoints.size(), ScanResult());
+  if (_scanPoints.empty()) {
+    return;
+  }
+
+  // thread t takes the points t, t+nThreads, ..., they only share the input
+  const unsigned nCores = std::max(1u, std::thread::hardware_concurrency());
+  const unsigned nThreads = std::min<unsigned>(_scanThreads > 0 ? _scanThreads : nCores, _scanPoints.size());
+  std::vector<std::exception_ptr> errors(nThreads);
+  std::vector< std::vector<Diagnostics::Message> > messages(nThreads);
+  TraceRecorder* recorder = TraceRecorder::current();
+  auto scan = [&](unsigned t) {
+    TraceRecorder::Scope trace(recorder);
+    Diagnostics::Capture capture(messages[t]);
+    try {
+      for (unsigned i = t; i < _scanPoints.size(); i += nThreads) {
+	fastjet::ClusterSequence cs(pjList, *_scanJetAlgos[i]);
+	ClusteringResult result;
+	findJets(pjList, cs, result);
+
+	ScanResult& scanResult = results[i];
+	const unsigned nJets = result.jets.size();
+	if (_clusterMode != FJ_inclusive && result.status == ClusteringResult::OK) {
+	  if (nJets > 1) scanResult.yNMinus1N = cs.exclusive_ymerge(nJets-1);
+	  scanResult.yNNPlus1 = cs.exclusive_ymerge(nJets);
+	}
+	for (unsigned j = 0; j < nJets; ++j) {
+	  scanResult.jets.push_back(result.jets[j].E());
+	  scanResult.jets.push_back(result.jets[j].px());
+	  scanResult.jets.push_back(result.jets[j].py());
+	  scanResult.jets.push_back(result.jets[j].pz());
+	  scanResult.jets.push_back(result.jets[j].m());
+	}
+      }
+    } catch (...) {
+      errors[t] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < nThreads; ++t) {
+    threads.push_back(std::thread(scan, t));
+  }
+  scan(0);
+  for (unsigned t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  // the warnings of findJets, written here as streamlog is not thread safe
+  for (unsigned t = 0; t < messages.size(); ++t) {
+    writeMessages(messages[t]);
+  }
+  for (unsigned t = 0; t < errors.size(); ++t) {
+    if (errors[t]) std::rethrow_exception(errors[t]);
+  }
+}
+
+void FastJetUtil::writeScan(int run, int event, const std::vector<ScanResult>& results) {
+
+  // one entry per grid point, the entries of the n-th event are n*nPoints up to (n+1)*nPoints-1
+  static const ScanResult skipped;
+  for (unsigned i = 0; i < _scanPoints.size(); ++i) {
+    const ScanResult& scanResult = i < results.size() ? results[i] : skipped;
+    _scanColumns->addEvent(run, event, scanResult.yNMinus1N, scanResult.yNNPlus1);
+    for (unsigned j = 0; j + 4 < scanResult.jets.size(); j += 5) {
+      _scanColumns->addJet(scanResult.jets[j], scanResult.jets[j+1], scanResult.jets[j+2], scanResult.jets[j+3], scanResult.jets[j+4], NULL, 0);
+    }
+    _statsScanJets[i] += scanResult.jets.size() / 5;
+  }
+  _statsScanEvents++;
+}
+
+void FastJetUtil::endScan() {
+
+  if (!_scanColumns) {
+    return;
+  }
+
+  if (!_scanColumns->close()) {
+    streamlog_out(ERROR) << "Could not write the scan file " << _scanColumns->fileName() << std::endl;
+  }
+
+  // the grid points in the order of their entries, with the average number of jets
+  const std::string pointsFileName = _scanColumns->fileName() + ".points";
+  std::ofstream points(pointsFileName.c_str());
+  points << "# point";
+  for (unsigned p = 0; p < _scanParameterNames.size(); ++p) {
+    points << " " << _scanParameterNames[p];
+  }
+  points << " jetsPerEvent algorithm\n";
+  for (unsigned i = 0; i < _scanPoints.size(); ++i) {
+    points << i;
+    for (unsigned p = 0; p < _scanPoints[i].size(); ++p) {
+      points << " " << _scanPoints[i][p];
+    }
+    points << " " << (_statsScanEvents > 0 ? (double)_statsScanJets[i]/_statsScanEvents : 0.0)
+	   << " " << _scanJetAlgos[i]->description() << "\n";
+  }
+  points.close();
+  if (!points) {
+    streamlog_out(ERROR) << "Could not write the grid points to " << pointsFileName << std::endl;
+  }
+
+  streamlog_out(MESSAGE) << "Scan file " << _scanColumns->fileName() << ": " << _statsScanEvents << " events for "
+			 << _scanPoints.size() << " grid points, listed in " << pointsFileName << std::endl;
+  _scanColumns.reset();
+}
+
+/// check the settings of the background estimation
+void FastJetUtil::initBackground() {
+
+  // the jets of the iterations come from their own clusterings, which have no areas to subtract with
+  if (_subtractBackground && _clusterMode == OWN_inclusiveIteration) {
+    throw Exception("subtractBackground cannot be combined with InclusiveIterativeNJets");
+  }
+
+  if (_subtractBackground && (!_backgroundEstimation || !_areaDefinition)) {
+    throw Exception("subtractBackground needs backgroundEstimation and a jetAreaType other than 'None'");
+  }
+
+  if (_backgroundEstimation) {
+    if (_backgroundGridMaxRap <= 0 || _backgroundGridSpacing <= 0) {
+      throw Exception("backgroundGridMaxRap and backgroundGridSpacing have to be positive");
+    }
+    streamlog_out(MESSAGE) << "Background estimation: grid median for |y| < " << _backgroundGridMaxRap
+			   << " with cells of " << _backgroundGridSpacing
+			   << (_subtractBackground ? ", subtracted from the jets" : "") << std::endl;
+  }
+}
+
 void FastJetUtil::initStrategy() {
   // we could provide a steering parameter for this and it would be parsed here.
   // however, when using the 'Best' clustering strategy FJ will chose automatically from a big list
@@ -482,82 +1438,413 @@ void FastJetUtil::initClusterMode() {
 
 }
 
-PseudoJetList FastJetUtil::clusterJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, LCCollection* reconstructedPars) {
+void FastJetUtil::findJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, ClusteringResult& result, unsigned nGhosts) {
   ///////////////////////////////
   // do the jet finding for the user defined parameter jet finder
 
-  PseudoJetList jets; // will contain the found jets
+  TraceRecorder::Span span("jet finding", "clustering");
+  span.arg("mode", _clusterModeName).arg("particles", pjList.size());
+
+  result = ClusteringResult();
 
   if (_clusterMode == FJ_inclusive) {
 
-    jets = cs.inclusive_jets(_minPt);
+    result.jets = cs.inclusive_jets(_minPt);
 
   } else if (_clusterMode == FJ_exclusive_yCut) {
 
-    jets = cs.exclusive_jets_ycut(_yCut);
+    result.jets = cs.exclusive_jets_ycut(_yCut);
 
-  } else if (_clusterMode == FJ_exclusive_nJets) {
+  } else if (_clusterMode == FJ_exclusive_nJets || _clusterMode == OWN_inclusiveIteration) {
 
     // sanity check: if we have not enough particles, FJ will cause an assert
-    if (reconstructedPars->getNumberOfElements() < (int)_requestedNumberOfJets) {
+    if (pjList.size() - nGhosts < _requestedNumberOfJets) {
 
-      streamlog_out(WARNING) << "Not enough elements in the input collection to create " << _requestedNumberOfJets << " jets." << std::endl;
-      throw SkippedFixedNrJetException();
+      if (const long n = _diagnostics.report("NotEnoughParticles")) {
+	std::ostringstream message;
+	message << "Not enough elements in the input collection to create " << _requestedNumberOfJets << " jets." << _diagnostics.note(n);
+	logMessage(true, message.str());
+      }
+      result.status = ClusteringResult::SKIPPED_FIXED_NR_JETS;
+      result.skipReason = "Not enough elements in the input collection";
+
+    } else if (_clusterMode == FJ_exclusive_nJets) {
+
+      result.jets = cs.exclusive_jets((int)(_requestedNumberOfJets));
 
     } else {
 
-      jets = cs.exclusive_jets((int)(_requestedNumberOfJets));
+      doIterativeInclusiveClustering(pjList, result);
 
     }
 
-  } else if (_clusterMode == OWN_inclusiveIteration) {
-
-    // sanity check: if we have not enough particles, FJ will cause an assert
-    if (reconstructedPars->getNumberOfElements() < (int)_requestedNumberOfJets) {
+  }
 
-      streamlog_out(WARNING) << "Not enough elements in the input collection to create " << _requestedNumberOfJets << " jets." << std::endl;
-      throw SkippedFixedNrJetException();
+  // jets of nothing but ghosts are no jets
+  if (nGhosts > 0) {
+    PseudoJetList jets;
+    for (unsigned j = 0; j < result.jets.size(); ++j) {
+      if (!onlyGhosts(cs, result.jets[j])) jets.push_back(result.jets[j]);
+    }
+    result.jets.swap(jets);
+
+    if (_clusterMode == FJ_exclusive_nJets && result.status == ClusteringResult::OK && result.jets.size() < _requestedNumberOfJets) {
+      if (const long n = _diagnostics.report("GhostOnlyJets")) {
+	std::ostringstream message;
+	message << "Only " << result.jets.size() << " of the " << _requestedNumberOfJets << " jets contain more than truth ghosts." << _diagnostics.note(n);
+	logMessage(true, message.str());
+      }
+      result.jets.clear();
+      result.status = ClusteringResult::SKIPPED_FIXED_NR_JETS;
+      result.skipReason = "Jets of nothing but truth ghosts";
+    }
+  }
 
-    } else {
+  span.arg("jets", result.jets.size()).arg("status", int(result.status));
+}
 
-      jets = doIterativeInclusiveClustering(pjList);
+PseudoJetList FastJetUtil::clusterJets(PseudoJetList& pjList, fastjet::ClusterSequence& cs, LCCollection* /*reconstructedPars*/, bool* fallback) {
 
-    }
+  ClusteringResult result;
+  findJets(pjList, cs, result);
+  if (fallback) *fallback = result.budgetFallback;
 
+  if (result.status == ClusteringResult::SKIPPED_FIXED_NR_JETS) {
+    throw SkippedFixedNrJetException();
+  } else if (result.status == ClusteringResult::SKIPPED_MAX_ITERATIONS) {
+    throw SkippedMaxIterationException( result.jets );
   }
 
-  return jets;
+  return result.jets;
 
 }
 
 
-PseudoJetList FastJetUtil::convertFromRecParticle(LCCollection* recCol) {
+PseudoJetList FastJetUtil::convertFromRecParticle(LCCollection* recCol, GridMedianBackground* background, ParticleTable* particles) {
+  const int nParticles = recCol->getNumberOfElements();
+  _statsInputParticles += nParticles;
+  if (particles) particles->resize(nParticles);
+
   // foreach RecoParticle in the LCCollection: convert it into a PseudoJet and and save it in our list
   PseudoJetList pjList;
-  for (int i = 0; i < recCol->getNumberOfElements(); ++i) {
+  if (!_inputSelection) {
+    pjList.reserve(nParticles);
+    for (int i = 0; i < nParticles; ++i) {
+      ReconstructedParticle* par = static_cast<ReconstructedParticle*> (recCol->getElementAt(i));
+      if (particles) (*particles)[i] = par;
+      pjList.push_back( fastjet::PseudoJet( par->getMomentum()[0],
+					     par->getMomentum()[1],
+					     par->getMomentum()[2],
+					     par->getEnergy() ) );
+      pjList.back().set_user_index(i);	// save the id of this recParticle
+      if (background) background->add(par->getMomentum()[0], par->getMomentum()[1], par->getMomentum()[2], par->getEnergy());
+    }
+    _statsSelectedParticles += nParticles;
+    return pjList;
+  }
+
+  // copy everything the selection needs into contiguous arrays first
+  std::vector<double> px(nParticles), py(nParticles), pz(nParticles), energy(nParticles);
+  std::vector<float> charge(nParticles);
+  std::vector<int> type(nParticles);
+  for (int i = 0; i < nParticles; ++i) {
     ReconstructedParticle* par = static_cast<ReconstructedParticle*> (recCol->getElementAt(i));
-    pjList.push_back( fastjet::PseudoJet( par->getMomentum()[0],
-					   par->getMomentum()[1],
-					   par->getMomentum()[2],
-					   par->getEnergy() ) );
-    pjList.back().set_user_index(i);	// save the id of this recParticle
+    if (particles) (*particles)[i] = par;
+    const double* mom = par->getMomentum();
+    px[i] = mom[0];
+    py[i] = mom[1];
+    pz[i] = mom[2];
+    energy[i] = par->getEnergy();
+    charge[i] = par->getCharge();
+    type[i] = std::abs(par->getType());
   }
 
+  // evaluate the cuts without branches, so that the compiler can vectorize the loop
+  const double minE = _inputMinE;
+  const double minPt2 = _inputMinPt > 0 ? _inputMinPt*_inputMinPt : -1.0;
+  const double maxCos2 = _inputMaxAbsCosTheta*_inputMaxAbsCosTheta;
+  const bool acceptCharged = _inputCharge != 2;
+  const bool acceptNeutral = _inputCharge != 1;
+  std::vector<char> pass(nParticles);
+  for (int i = 0; i < nParticles; ++i) {
+    const double pt2 = px[i]*px[i] + py[i]*py[i];
+    const double p2 = pt2 + pz[i]*pz[i];
+    const bool charged = std::fabs(charge[i]) > 0.5f;
+    pass[i] = (energy[i] >= minE) & (pt2 >= minPt2) & (pz[i]*pz[i] <= maxCos2*p2)
+      & ((charged & acceptCharged) | (!charged & acceptNeutral));
+  }
+  for (unsigned t = 0; t < _inputExcludedTypes.size(); ++t) {
+    const int excluded = std::abs(_inputExcludedTypes[t]);
+    for (int i = 0; i < nParticles; ++i) {
+      pass[i] &= (type[i] != excluded);
+    }
+  }
+
+  // the user_index still points to the particle in the input collection
+  for (int i = 0; i < nParticles; ++i) {
+    if (!pass[i]) continue;
+    pjList.push_back( fastjet::PseudoJet( px[i], py[i], pz[i], energy[i] ) );
+    pjList.back().set_user_index(i);
+    if (background) background->add(px[i], py[i], pz[i], energy[i]);
+  }
+  _statsSelectedParticles += pjList.size();
+
   return pjList;
 }
 
-EVENT::ReconstructedParticle* FastJetUtil::convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, LCCollection* reconstructedPars){
-  
-  // create a ReconstructedParticle that saves the jet                                                                                                                                                                                                               
-  ReconstructedParticleImpl* reco = new ReconstructedParticleImpl();
-  
-  // save the jet's parameters                                                                                                                                                                                                                                       
-  reco->setEnergy( jet.E() );
-  reco->setMass( jet.m() );
+std::string FastJetUtil::clusteringKey(const std::string& collectionName) const {
+
+  // the jet definition description contains the algorithm and all its parameters
+  std::ostringstream key;
+  key << collectionName << "|" << _jetAlgo->description() << "|" << _jetRecoSchemeName;
+  // a different selection of the input particles gives a different clustering
+  if (_inputSelection) {
+    key << "|" << _inputMinE << "|" << _inputMinPt << "|" << _inputMaxAbsCosTheta << "|" << _inputCharge;
+    for (unsigned t = 0; t < _inputExcludedTypes.size(); ++t) key << "|" << _inputExcludedTypes[t];
+  }
+  if (_softEnergyThreshold > 0) {
+    // convertInput keeps all particles hard if the split leaves fewer than the requested jets
+    key << "|soft " << _softEnergyThreshold << " " << _clusterModeName << " " << _requestedNumberOfJets;
+  }
+  if (_areaDefinition) {
+    key << "|" << _areaDefinition->description() << "|" << _areaSeed;
+  }
+  if (_backgroundEstimation) {
+    key << "|rho " << _backgroundGridMaxRap << " " << _backgroundGridSpacing;
+  }
+  return key.str();
+}
+
+ClusterSequenceCache::EntryPtr FastJetUtil::getClusterSequence(LCEvent* evt, const std::string& collectionName, LCCollection* recCol) {
+
+  const std::string key = clusteringKey(collectionName);
+
+  ClusterSequenceCache::EntryPtr entry;
+  if (_shareClusterSequence) {
+    entry = ClusterSequenceCache::instance().find(evt, key);
+    if (entry) {
+      _statsCacheHits++;
+      return entry;
+    }
+    _statsCacheMisses++;
+  }
+
+  entry = std::make_shared<ClusterSequenceCache::Entry>();
+  convertInput(recCol, *entry);
+  entry->cs = makeClusterSequence(entry->pjList);
+
+  if (_shareClusterSequence) {
+    ClusterSequenceCache::instance().insert(evt, key, entry);
+  }
+
+  return entry;
+}
+
+std::shared_ptr<fastjet::ClusterSequence> FastJetUtil::makeClusterSequence(const PseudoJetList& pjList) {
+
+  TraceRecorder::Span span("clustering", "clustering");
+  if (span.active()) span.arg("particles", pjList.size()).arg("algorithm", _jetAlgo->description());
+
+  typedef std::chrono::steady_clock Clock;
+  const Clock::time_point start = Clock::now();
+
+  std::shared_ptr<fastjet::ClusterSequence> cs;
+  if (!_areaDefinition) {
+    cs = std::make_shared<fastjet::ClusterSequence>(pjList, *_jetAlgo);
+  } else {
+    // each call gets its own copy with the random generator in the job state, this is also thread safe
+    fastjet::AreaDefinition areaDefinition(*_areaDefinition);
+    areaDefinition.ghost_spec().set_random_status(_areaSeeds);
+    cs = std::make_shared<fastjet::ClusterSequenceArea>(pjList, *_jetAlgo, areaDefinition);
+  }
+
+  const double time = std::chrono::duration<double>(Clock::now() - start).count();
+  bool sample = false;
+  {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _statsClusteringTime += time;
+    sample = _areaDefinition && _statsClusterings % AREA_TIMING_SAMPLE == 0;
+    _statsClusterings++;
+  }
+
+  if (sample) {
+    const Clock::time_point plainStart = Clock::now();
+    fastjet::ClusterSequence plain(pjList, *_jetAlgo);
+    const double plainTime = std::chrono::duration<double>(Clock::now() - plainStart).count();
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _statsAreaSamplePlainTime += plainTime;
+    _statsAreaSampleTime += time;
+    _statsAreaSamples++;
+  }
+
+  return cs;
+}
+
+void FastJetUtil::storeJetAreas(const PseudoJetList& jets, const fastjet::ClusterSequence& cs, LCCollection* jetCol) {
+
+  const fastjet::ClusterSequenceAreaBase* csArea = dynamic_cast<const fastjet::ClusterSequenceAreaBase*>(&cs);
+  if (!csArea) {
+    return;
+  }
+
+  EVENT::FloatVec areas, areaErrors;
+  areas.reserve(jets.size());
+  areaErrors.reserve(jets.size());
+  for (unsigned j = 0; j < jets.size(); ++j) {
+    areas.push_back(csArea->area(jets[j]));
+    areaErrors.push_back(csArea->area_error(jets[j]));
+  }
+  jetCol->parameters().setValues(std::string("JetArea"), areas);
+  jetCol->parameters().setValues(std::string("JetAreaError"), areaErrors);
+}
+
+void FastJetUtil::storeBackground(const ClusterSequenceCache::Entry& entry, LCCollection* jetCol) {
+
+  if (!_backgroundEstimation) {
+    return;
+  }
+  jetCol->parameters().setValue(std::string("rho"), float(entry.rho));
+  jetCol->parameters().setValue(std::string("sigma"), float(entry.sigma));
+}
+
+void FastJetUtil::subtractBackground(fastjet::PseudoJet& jet, const fastjet::PseudoJet& clusteredJet, const fastjet::ClusterSequence& cs, double rho) {
+
+  const fastjet::ClusterSequenceAreaBase* csArea = dynamic_cast<const fastjet::ClusterSequenceAreaBase*>(&cs);
+  if (!csArea) {
+    return;
+  }
+
+  // same as fastjet::Subtractor: if the background is larger than the jet, nothing is left
+  const fastjet::PseudoJet background = rho*csArea->area_4vector(clusteredJet);
+  if (background.perp2() >= jet.perp2() || background.E() >= jet.E()) {
+    jet.reset_momentum(0.0, 0.0, 0.0, 0.0);
+  } else {
+    jet.reset_momentum(jet.px() - background.px(), jet.py() - background.py(), jet.pz() - background.pz(), jet.E() - background.E());
+  }
+}
+
+void FastJetUtil::printTimingSummary() {
+
+  streamlog_out(MESSAGE)
+    << "Clustering time: " << _statsClusteringTime << " s"
+    << " (" << (_statsClusterings > 0 ? 1000.0*_statsClusteringTime/_statsClusterings : 0.0) << " ms per event)"
+    << std::endl;
+
+  if (_areaDefinition && _statsAreaSamples > 0) {
+    streamlog_out(MESSAGE)
+      << "Jet area overhead: " << 1000.0*(_statsAreaSampleTime - _statsAreaSamplePlainTime)/_statsAreaSamples << " ms per event"
+      << " (clustering " << (_statsAreaSamplePlainTime > 0 ? _statsAreaSampleTime/_statsAreaSamplePlainTime : 0.0)
+      << " times slower, measured on " << _statsAreaSamples << " events)"
+      << std::endl;
+  }
+}
+
+void FastJetUtil::writeStatistics(std::ostream& out) const {
+  out << "ClusterSequenceCacheHits " << _statsCacheHits << "\n"
+      << "ClusterSequenceCacheMisses " << _statsCacheMisses << "\n"
+      << "InputParticles " << _statsInputParticles << "\n"
+      << "SelectedParticles " << _statsSelectedParticles << "\n"
+      << "SoftParticles " << _statsSoftParticles << "\n"
+      << "AttachedSoftParticles " << _statsAttachedSoftParticles << "\n"
+      << "Clusterings " << _statsClusterings << "\n"
+      << "ClusteringTime " << _statsClusteringTime << "\n"
+      << "RhoSum " << _statsRhoSum << "\n"
+      << "RhoEvents " << _statsRhoEvents << "\n";
+  const std::map<std::string, long> counts = _diagnostics.counts();
+  for (std::map<std::string, long>::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+    out << "Diagnostics" << it->first << " " << it->second << "\n";
+  }
+}
+
+void FastJetUtil::convertInput(LCCollection* recCol, ClusterSequenceCache::Entry& entry) {
+
+  TraceRecorder::Span span("conversion", "input");
+  span.arg("particles", recCol->getNumberOfElements());
+
+  if (_backgroundEstimation) {
+    GridMedianBackground background(_backgroundGridMaxRap, _backgroundGridSpacing);
+    entry.pjList = convertFromRecParticle(recCol, &background, &entry.particles);
+    background.estimate(entry.rho, entry.sigma);
+    _statsRhoSum += entry.rho;
+    _statsRhoEvents++;
+  } else {
+    entry.pjList = convertFromRecParticle(recCol, NULL, &entry.particles);
+  }
+  entry.softList.clear();
+
+  if (_softEnergyThreshold <= 0) {
+    return;
+  }
+
+  // keep the order of the hard particles, so the clustering does not depend on the threshold otherwise
+  PseudoJetList hardList;
+  hardList.reserve(entry.pjList.size());
+  for (unsigned i = 0; i < entry.pjList.size(); ++i) {
+    if (entry.pjList[i].E() < _softEnergyThreshold) {
+      entry.softList.push_back(entry.pjList[i]);
+    } else {
+      hardList.push_back(entry.pjList[i]);
+    }
+  }
+  // a fixed number of jets needs as many particles in the clustering, cluster them all as without the threshold
+  if ((_clusterMode == FJ_exclusive_nJets || _clusterMode == OWN_inclusiveIteration) && hardList.size() < _requestedNumberOfJets) {
+    entry.softList.clear();
+    return;
+  }
+  entry.pjList.swap(hardList);
+  _statsSoftParticles += entry.softList.size();
+}
+
+void FastJetUtil::attachSoftParticles(const PseudoJetList& jets, const PseudoJetList& softList, std::vector<PseudoJetList>& softConstituents) {
+
+  softConstituents.assign(jets.size(), PseudoJetList());
+  if (jets.empty()) {
+    return;
+  }
+
+  // nearest jet in angle: opening angle for e+e- algorithms, (y,phi) distance otherwise. This is not the
+  // distance measure of the algorithm, which would weight the jets by their energy or transverse momentum
+  const fastjet::JetDefinition::Plugin* plugin = _jetAlgo->plugin();
+  const bool spherical = plugin ? plugin->is_spherical() :
+    (_jetAlgoType == fastjet::ee_kt_algorithm || _jetAlgoType == fastjet::ee_genkt_algorithm);
+  // without a spherical measure the particle would have been a jet of its own beyond R
+  const double maxDistance = spherical ? std::numeric_limits<double>::max() : _jetAlgo->R()*_jetAlgo->R();
+
+  for (unsigned i = 0; i < softList.size(); ++i) {
+    const fastjet::PseudoJet& soft = softList[i];
+    int closest = -1;
+    double closestDistance = maxDistance;
+    for (unsigned j = 0; j < jets.size(); ++j) {
+      double distance;
+      if (spherical) {
+	const double norm = soft.modp()*jets[j].modp();
+	distance = norm > 0 ? 1.0 - (soft.px()*jets[j].px() + soft.py()*jets[j].py() + soft.pz()*jets[j].pz())/norm : 1.0;
+      } else {
+	distance = soft.squared_distance(jets[j]);
+      }
+      if (distance < closestDistance) {
+	closestDistance = distance;
+	closest = j;
+      }
+    }
+    if (closest >= 0) {
+      softConstituents[closest].push_back(soft);
+      _statsAttachedSoftParticles++;
+    }
+  }
+}
+
+EVENT::ReconstructedParticle* FastJetUtil::convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, LCCollection* reconstructedPars,
+								ConstituentIndexList* indexList){
   
-  double mom[3] = {jet.px(), jet.py(), jet.pz()};
-  reco->setMomentum( mom );
+  ReconstructedParticleImpl* reco = newJetParticle(jet);
   
+  // only the indices are kept, the particles are not referenced from the jet
+  if (_constituentIndices) {
+    if (indexList) indexList->add(constituents);
+    return reco;
+  }
+
   // add information about the included particles                                                                                                                                                                                                                    
   for (unsigned int n = 0; n < constituents.size(); ++n)
     {
@@ -569,7 +1856,53 @@ EVENT::ReconstructedParticle* FastJetUtil::convertFromPseudoJet(const fastjet::P
   return reco;
 }
 
-PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList) {
+EVENT::ReconstructedParticle* FastJetUtil::convertFromPseudoJet(const fastjet::PseudoJet& jet, const PseudoJetList& constituents, const ParticleTable& particles,
+								ConstituentIndexList* indexList){
+
+  ReconstructedParticleImpl* reco = newJetParticle(jet);
+
+  if (_constituentIndices) {
+    if (indexList) indexList->add(constituents);
+    return reco;
+  }
+
+  for (unsigned int n = 0; n < constituents.size(); ++n) {
+    reco->addParticle( particles[constituents[n].user_index()] );
+  }
+
+  return reco;
+}
+
+IMPL::ReconstructedParticleImpl* FastJetUtil::newJetParticle(const fastjet::PseudoJet& jet) {
+
+  // create a ReconstructedParticle that saves the jet
+  ReconstructedParticleImpl* reco = new ReconstructedParticleImpl();
+
+  // save the jet's parameters
+  reco->setEnergy( jet.E() );
+  reco->setMass( jet.m() );
+
+  double mom[3] = {jet.px(), jet.py(), jet.pz()};
+  reco->setMomentum( mom );
+
+  return reco;
+}
+
+double FastJetUtil::threadCpuTime() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+bool FastJetUtil::onlyGhosts(const fastjet::ClusterSequence& cs, const fastjet::PseudoJet& jet) {
+  const PseudoJetList constituents = cs.constituents(jet);
+  for (unsigned n = 0; n < constituents.size(); ++n) {
+    if (!TruthGhosts::isGhost(constituents[n])) return false;
+  }
+  return true;
+}
+
+void FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList, ClusteringResult& result) {
   // lets do a iterative procedure until we found the correct number of jets
   // for that we will do inclusive clustering, modifying the R parameter in some kind of minimization
   // this is based on Marco Battaglia's FastJetClustering
@@ -578,7 +1911,7 @@ PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList
   double RDiff = R / 2;	// the step size we modify the R parameter at each iteration. Its size for the n-th step is R/(2n), i.e. starts with R/2
   PseudoJetList jets;
   PseudoJetList jetsReturn;
-  unsigned nJets;
+  unsigned nJets = 0;
   int iIter = 0;	// nr of current iteration
 
   // these variables are only used if the SisCone(Spherical)Plugin is selected
@@ -605,7 +1938,32 @@ PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList
   // R = Pi/4 + Pi/8 - Pi/16
   // R = Pi/4 + Pi/8 - Pi/16 + Pi/32
   // ...
-  for (iIter=0; iIter<ITERATIVE_INCLUSIVE_MAX_ITERATIONS; iIter++) {
+  // the input, strategy and number of iterations change once the event is over its time budget
+  const double startTime = _eventTimeBudget > 0 ? threadCpuTime() : 0.0;
+  bool overBudget = false;
+  int maxIterations = ITERATIVE_INCLUSIVE_MAX_ITERATIONS;
+  fastjet::Strategy strategy = _strategy;
+  PseudoJetList selectedList;
+  const PseudoJetList* input = &pjList;
+
+  for (iIter=0; iIter<maxIterations; iIter++) {
+
+    if (_eventTimeBudget > 0 && !overBudget && threadCpuTime() - startTime > _eventTimeBudget) {
+      overBudget = true;
+      result.budgetFallback = true;
+      maxIterations = std::min(maxIterations, iIter + _fallbackMaxIterations);
+      strategy = _fallbackStrategy;
+      if (_fallbackInputMinE > 0) {
+	for (unsigned i = 0; i < pjList.size(); ++i) {
+	  if (pjList[i].E() >= _fallbackInputMinE) selectedList.push_back(pjList[i]);
+	}
+	input = &selectedList;
+      }
+      if (iIter >= maxIterations) break;
+    }
+
+    TraceRecorder::Span step("R step", "clustering");
+    step.arg("iteration", iIter).arg("R", R).arg("particles", input->size());
 
     // do the clustering for this value of R. For this we need to re-initialize the JetDefinition, as it takes the R parameter
     fastjet::JetDefinition* jetDefinition = NULL;
@@ -618,11 +1976,13 @@ PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList
       pluginSisConeSph = new fastjet::SISConeSphericalPlugin(R, sisConeOverlapThreshold);
       jetDefinition = new fastjet::JetDefinition(pluginSisConeSph);
     } else {
-      jetDefinition = new fastjet::JetDefinition(_jetAlgoType, R, _jetRecoScheme, _strategy);
+      jetDefinition = new fastjet::JetDefinition(_jetAlgoType, R, _jetRecoScheme, strategy);
     }
 
     // now we can finally create the cluster sequence
-    fastjet::ClusterSequence cs(pjList, *jetDefinition);
+    fastjet::ClusterSequence cs(*input, *jetDefinition);
+    result.iterations++;
+    result.finalR = R;
 
     jets = cs.inclusive_jets(0);	// no pt cut, we will do an energy cut
     jetsReturn.clear();
@@ -633,8 +1993,7 @@ PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList
       if (jets[j].E() > _minE)
 	jetsReturn.push_back(jets[j]);
     nJets = jetsReturn.size();
-
-    streamlog_out(DEBUG) << iIter << " " << R << " " << jets.size() << " " << nJets << std::endl;
+    step.arg("jets", nJets);
 
     if (nJets == _requestedNumberOfJets) { // if the number of jets is correct: success!
       delete pluginSisCone; pluginSisCone = NULL;
@@ -661,14 +2020,24 @@ PseudoJetList FastJetUtil::doIterativeInclusiveClustering( PseudoJetList& pjList
 
   }
 
-  if (iIter == ITERATIVE_INCLUSIVE_MAX_ITERATIONS) {
-    streamlog_out(WARNING) << "Maximum number of iterations reached. Canceling" << std::endl;
-    throw SkippedMaxIterationException( jets );
+  if (streamlog_level(DEBUG)) {
+    std::ostringstream message;
+    message << "Iterations: " << result.iterations << " - final R: " << result.finalR << " - jets above minE: " << nJets;
+    logMessage(false, message.str());
+  }
+
+  if (iIter == maxIterations) {
+    if (const long n = _diagnostics.report("MaxIterations")) {
+      logMessage(true, "Maximum number of iterations reached. Canceling" + _diagnostics.note(n));
+    }
     // Currently we will return the latest results, independent if the number is actually matched
-    // jetsReturn.clear();
+    result.status = ClusteringResult::SKIPPED_MAX_ITERATIONS;
+    result.skipReason = "Maximum number of iterations reached";
+    result.jets.swap(jets);
+    return;
   }
 
-  return jetsReturn;
+  result.jets.swap(jetsReturn);
 }
 
 #endif // FastJetUtil_h
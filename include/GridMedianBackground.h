@@ -0,0 +1,75 @@
+#ifndef GRIDMEDIANBACKGROUND_H
+#define GRIDMEDIANBACKGROUND_H 1
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * Grid-median estimate of the background density, the same estimate as
+ * fastjet::GridMedianBackgroundEstimator but filled particle by particle.
+ *
+ * The (y,phi) plane up to |y| < maxRap is divided into square-ish cells of about
+ * spacing x spacing. The particles' pt is summed per cell while the input is
+ * converted, afterwards rho is the median of pt/area over all cells (empty ones
+ * included) and sigma the spread of the lower half, scaled to unit area. Both
+ * need a single pass over the particles and a linear median over the cells, no
+ * clustering.
+ */
+class GridMedianBackground {
+
+public:
+  GridMedianBackground(double maxRap, double spacing)
+    : _maxRap(maxRap), _nRap(1), _nPhi(1), _dRap(0.0), _dPhi(0.0), _cellPt() {
+    if (spacing > 0) {
+      _nRap = std::max(1, int(2*maxRap/spacing + 0.5));
+      _nPhi = std::max(1, int(2*M_PI/spacing + 0.5));
+    }
+    _dRap = 2*maxRap/_nRap;
+    _dPhi = 2*M_PI/_nPhi;
+    _cellPt.assign(_nRap*_nPhi, 0.0);
+  }
+
+  /// add one particle, particles outside the grid are ignored
+  void add(double px, double py, double pz, double E) {
+    if (E <= std::abs(pz)) return;
+    const double rap = 0.5*std::log((E + pz)/(E - pz));
+    if (std::abs(rap) >= _maxRap) return;
+    double phi = std::atan2(py, px);
+    if (phi < 0) phi += 2*M_PI;
+    const int iRap = std::min(_nRap - 1, int((rap + _maxRap)/_dRap));
+    const int iPhi = std::min(_nPhi - 1, int(phi/_dPhi));
+    _cellPt[iRap*_nPhi + iPhi] += std::sqrt(px*px + py*py);
+  }
+
+  /// median pt density and its fluctuation per unit area
+  void estimate(double& rho, double& sigma) const {
+    const double cellArea = _dRap*_dPhi;
+    std::vector<double> density(_cellPt);
+    const unsigned n = density.size();
+
+    const unsigned iMedian = n/2;
+    std::nth_element(density.begin(), density.begin() + iMedian, density.end());
+    rho = density[iMedian]/cellArea;
+
+    // the 1-sigma lower quantile lies in the lower part, which nth_element left unsorted before the median
+    const unsigned iLow = unsigned(0.1587*(n - 1) + 0.5);
+    std::nth_element(density.begin(), density.begin() + iLow, density.begin() + iMedian);
+    const double low = iLow < iMedian ? density[iLow]/cellArea : rho;
+    sigma = (rho - low)*std::sqrt(cellArea);
+  }
+
+  unsigned nCells() const { return _cellPt.size(); }
+  double cellArea() const { return _dRap*_dPhi; }
+
+private:
+  double _maxRap;
+  int _nRap;
+  int _nPhi;
+  double _dRap;
+  double _dPhi;
+  std::vector<double> _cellPt;
+
+}; //end class GridMedianBackground
+
+#endif // GRIDMEDIANBACKGROUND_H
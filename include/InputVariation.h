@@ -0,0 +1,123 @@
+#ifndef INPUTVARIATION_H
+#define INPUTVARIATION_H 1
+
+#include "ClusterSequenceCache.h"
+
+#include <EVENT/ReconstructedParticle.h>
+
+#include <fastjet/PseudoJet.hh>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+
+/**
+ * A systematic variation of the input particles, applied to the converted pseudo jets of an event
+ * before they are clustered again:
+ *  EnergyScale <f>          all four-momenta times f
+ *  NeutralHadronScale <f>   the four-momenta of the neutral particles other than photons times f
+ *  PhotonScale <f>          the four-momenta of the photons times f
+ *  ChargedScale <f>         the four-momenta of the charged particles times f
+ *  TrackSmearing <sigma>    the momenta of the charged particles times a gaussian with mean 1 and
+ *                           width sigma, at constant mass; the factor is cut off at 0, so a track
+ *                           is never turned around
+ * The smearing is seeded with the run, the event and the name of the variation, so it is the same
+ * in every job and does not depend on the order of the variations.
+ */
+class InputVariation {
+
+public:
+  enum Type { ENERGY_SCALE, NEUTRAL_HADRON_SCALE, PHOTON_SCALE, CHARGED_SCALE, TRACK_SMEARING };
+
+  InputVariation(const std::string& name, Type type, double value): _name(name), _type(type), _value(value) {}
+
+  /// the type of the given name, false if there is none
+  static bool typeFromName(const std::string& typeName, Type& type) {
+    if (typeName == "EnergyScale") type = ENERGY_SCALE;
+    else if (typeName == "NeutralHadronScale") type = NEUTRAL_HADRON_SCALE;
+    else if (typeName == "PhotonScale") type = PHOTON_SCALE;
+    else if (typeName == "ChargedScale") type = CHARGED_SCALE;
+    else if (typeName == "TrackSmearing") type = TRACK_SMEARING;
+    else return false;
+    return true;
+  }
+
+  const std::string& name() const { return _name; }
+  Type type() const { return _type; }
+  double value() const { return _value; }
+
+  /// name, type and value, e.g. "NHUp NeutralHadronScale 1.05"
+  std::string description() const {
+    static const char* typeNames[] = {"EnergyScale", "NeutralHadronScale", "PhotonScale", "ChargedScale", "TrackSmearing"};
+    std::ostringstream description;
+    description << _name << " " << typeNames[_type] << " " << _value;
+    return description.str();
+  }
+
+  /// the varied copy of pjList, the user_index of the pseudo jets points into particles
+  inline void apply(const PseudoJetList& pjList, const ParticleTable& particles, int run, int event, PseudoJetList& varied) const;
+
+private:
+  enum Kind { CHARGED, PHOTON, NEUTRAL_HADRON };
+
+  static Kind kind(const EVENT::ReconstructedParticle* particle) {
+    if (std::fabs(particle->getCharge()) > 0.5f) return CHARGED;
+    return std::abs(particle->getType()) == 22 ? PHOTON : NEUTRAL_HADRON;
+  }
+
+  bool varies(Kind kind) const {
+    switch (_type) {
+    case ENERGY_SCALE: return true;
+    case NEUTRAL_HADRON_SCALE: return kind == NEUTRAL_HADRON;
+    case PHOTON_SCALE: return kind == PHOTON;
+    case CHARGED_SCALE:
+    case TRACK_SMEARING: return kind == CHARGED;
+    }
+    return false;
+  }
+
+  std::string _name;
+  Type _type;
+  double _value;
+
+}; //end class InputVariation
+
+
+void InputVariation::apply(const PseudoJetList& pjList, const ParticleTable& particles, int run, int event, PseudoJetList& varied) const {
+
+  // FNV-1a of the name, std::hash may differ between compilers
+  std::uint32_t nameHash = 2166136261u;
+  for (unsigned i = 0; i < _name.size(); ++i) {
+    nameHash = (nameHash ^ (unsigned char)_name[i]) * 16777619u;
+  }
+  std::seed_seq seed{std::uint32_t(run), std::uint32_t(event), nameHash};
+  std::mt19937 random(seed);
+  std::normal_distribution<double> gauss(1.0, _type == TRACK_SMEARING ? _value : 1.0);
+
+  varied.clear();
+  varied.reserve(pjList.size());
+  for (unsigned i = 0; i < pjList.size(); ++i) {
+    const fastjet::PseudoJet& pj = pjList[i];
+    // the MC truth ghosts are no input particles
+    if (pj.user_index() < 0 || !varies(kind(particles[pj.user_index()]))) {
+      varied.push_back(pj);
+      continue;
+    }
+
+    if (_type == TRACK_SMEARING) {
+      const double f = std::max(0.0, gauss(random));
+      const double m2 = std::max(0.0, pj.m2());
+      const double p2 = f*f*(pj.px()*pj.px() + pj.py()*pj.py() + pj.pz()*pj.pz());
+      varied.push_back(fastjet::PseudoJet(f*pj.px(), f*pj.py(), f*pj.pz(), std::sqrt(p2 + m2)));
+    } else {
+      varied.push_back(fastjet::PseudoJet(_value*pj.px(), _value*pj.py(), _value*pj.pz(), _value*pj.E()));
+    }
+    varied.back().set_user_index(pj.user_index());
+  }
+}
+
+#endif
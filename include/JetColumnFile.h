@@ -0,0 +1,343 @@
+#ifndef JETCOLUMNFILE_H
+#define JETCOLUMNFILE_H 1
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Columnar file of jets, written by FastJetProcessor (jetColumnFile) and meant to be memory mapped
+ * by the analysis, without LCIO. This header depends on nothing but the C++ and POSIX libraries.
+ *
+ * Every column is one contiguous array, aligned to 64 bytes:
+ *
+ *   event_run, event_number            int32,   one per event
+ *   event_y_n-1_n, event_y_n_n+1       float32, one per event, NaN if the jet collection has no y values
+ *   event_jet_begin                    uint64,  one per event plus one, the jets of event i are
+ *                                               event_jet_begin[i] up to event_jet_begin[i+1]-1
+ *   jet_e, jet_px, jet_py, jet_pz, jet_m float64, one per jet
+ *   jet_constituent_begin              uint64,  one per jet plus one, like event_jet_begin
+ *   constituent_index                  int32,   index of the particle in the input collection of the event
+ *
+ * The file starts with a fixed header and a table of the columns, see Header and ColumnEntry. It is
+ * written in the byte order of the writing machine. The writer keeps each column in its own
+ * temporary file next to the output and puts them together in close(), so the file only appears
+ * once it is complete.
+ */
+namespace JetColumnFile {
+
+  enum {
+    FORMAT_VERSION = 1,
+    ALIGNMENT = 64,
+    NAME_SIZE = 24
+  };
+
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t nColumns;
+    std::uint64_t nEvents;
+    std::uint64_t nJets;
+    std::uint64_t nConstituents;
+  };
+
+  struct ColumnEntry {
+    char name[NAME_SIZE];
+    /// 'i' int32, 'f' float32, 'd' float64, 'u' uint64
+    std::uint32_t type;
+    std::uint32_t elementSize;
+    std::uint64_t offset;
+    std::uint64_t count;
+  };
+
+  inline std::uint32_t typeCode(const std::int32_t*) { return 'i'; }
+  inline std::uint32_t typeCode(const float*) { return 'f'; }
+  inline std::uint32_t typeCode(const double*) { return 'd'; }
+  inline std::uint32_t typeCode(const std::uint64_t*) { return 'u'; }
+
+}
+
+
+class JetColumnWriter {
+
+public:
+  JetColumnWriter(): _fileName(""), _columns(), _nEvents(0), _nJets(0), _nConstituents(0) {}
+
+  ~JetColumnWriter() {
+    for (unsigned i = 0; i < _columns.size(); ++i) {
+      if (_columns[i].file) {
+	fclose(_columns[i].file);
+	remove(_columns[i].fileName.c_str());
+      }
+    }
+  }
+
+  /// creates the temporary column files, returns false if that fails
+  bool open(const std::string& fileName);
+
+  /// starts the next event, its jets follow with addJet
+  void addEvent(int run, int event, float yNMinus1N, float yNNPlus1);
+
+  /// adds a jet to the last event, with the indices of its constituents in the input collection
+  void addJet(double e, double px, double py, double pz, double m, const int* constituents, unsigned nConstituents);
+
+  /// writes the file, returns false if that fails
+  bool close();
+
+  const std::string& fileName() const { return _fileName; }
+  std::uint64_t nEvents() const { return _nEvents; }
+  std::uint64_t nJets() const { return _nJets; }
+
+private:
+  enum ColumnId { EVENT_RUN, EVENT_NUMBER, EVENT_Y_N_MINUS_1_N, EVENT_Y_N_N_PLUS_1, EVENT_JET_BEGIN,
+		  JET_E, JET_PX, JET_PY, JET_PZ, JET_M, JET_CONSTITUENT_BEGIN, CONSTITUENT_INDEX, N_COLUMNS };
+
+  struct Column {
+    std::string name;
+    std::uint32_t type;
+    std::uint32_t elementSize;
+    std::string fileName;
+    FILE* file;
+    std::uint64_t count;
+  };
+
+  template <class T> void put(ColumnId id, T value) {
+    Column& column = _columns[id];
+    if (fwrite(&value, sizeof(value), 1, column.file) == 1) ++column.count;
+  }
+
+  template <class T> void addColumn(const std::string& name) {
+    Column column = {name, JetColumnFile::typeCode((const T*)NULL), sizeof(T), "", NULL, 0};
+    _columns.push_back(column);
+  }
+
+  JetColumnWriter(const JetColumnWriter&) = delete;
+  JetColumnWriter& operator=(const JetColumnWriter&) = delete;
+
+  std::string _fileName;
+  std::vector<Column> _columns;
+  std::uint64_t _nEvents;
+  std::uint64_t _nJets;
+  std::uint64_t _nConstituents;
+
+}; //end class JetColumnWriter
+
+
+/**
+ * Read only view of a jet column file. The columns point directly into the mapped file, they stay
+ * valid as long as the reader exists.
+ */
+class JetColumnReader {
+
+public:
+  JetColumnReader(): _data(NULL), _size(0), _eventJetBegin(NULL) {}
+
+  ~JetColumnReader() {
+    if (_data) munmap(_data, _size);
+  }
+
+  /// maps the file, returns false if it cannot be read, is not a jet column file of this version or
+  /// its offset columns do not match the numbers of events, jets and constituents
+  bool open(const std::string& fileName);
+
+  std::uint64_t nEvents() const { return header().nEvents; }
+  std::uint64_t nJets() const { return header().nJets; }
+  std::uint64_t nConstituents() const { return header().nConstituents; }
+
+  /// the column with the given name, NULL if there is none of this type
+  template <class T> const T* column(const std::string& name, std::uint64_t* count = NULL) const;
+
+  /// the jets of event i are jetBegin(i) up to jetEnd(i)-1
+  std::uint64_t jetBegin(std::uint64_t i) const { return _eventJetBegin[i]; }
+  std::uint64_t jetEnd(std::uint64_t i) const { return _eventJetBegin[i+1]; }
+
+private:
+  const JetColumnFile::Header& header() const { return *static_cast<const JetColumnFile::Header*>(_data); }
+
+  /// an offset column with n+1 non-decreasing entries from 0 to total
+  bool validOffsets(const std::string& name, std::uint64_t n, std::uint64_t total) const;
+
+  JetColumnReader(const JetColumnReader&) = delete;
+  JetColumnReader& operator=(const JetColumnReader&) = delete;
+
+  void* _data;
+  size_t _size;
+  const std::uint64_t* _eventJetBegin;
+
+}; //end class JetColumnReader
+
+
+inline bool JetColumnWriter::open(const std::string& fileName) {
+  _fileName = fileName;
+  _columns.clear();
+  addColumn<std::int32_t>("event_run");
+  addColumn<std::int32_t>("event_number");
+  addColumn<float>("event_y_n-1_n");
+  addColumn<float>("event_y_n_n+1");
+  addColumn<std::uint64_t>("event_jet_begin");
+  addColumn<double>("jet_e");
+  addColumn<double>("jet_px");
+  addColumn<double>("jet_py");
+  addColumn<double>("jet_pz");
+  addColumn<double>("jet_m");
+  addColumn<std::uint64_t>("jet_constituent_begin");
+  addColumn<std::int32_t>("constituent_index");
+
+  for (unsigned i = 0; i < _columns.size(); ++i) {
+    _columns[i].fileName = fileName + "." + _columns[i].name + ".part";
+    _columns[i].file = fopen(_columns[i].fileName.c_str(), "w+b");
+    if (!_columns[i].file) return false;
+  }
+  return true;
+}
+
+inline void JetColumnWriter::addEvent(int run, int event, float yNMinus1N, float yNNPlus1) {
+  put<std::int32_t>(EVENT_RUN, run);
+  put<std::int32_t>(EVENT_NUMBER, event);
+  put<float>(EVENT_Y_N_MINUS_1_N, yNMinus1N);
+  put<float>(EVENT_Y_N_N_PLUS_1, yNNPlus1);
+  put<std::uint64_t>(EVENT_JET_BEGIN, _nJets);
+  ++_nEvents;
+}
+
+inline void JetColumnWriter::addJet(double e, double px, double py, double pz, double m, const int* constituents, unsigned nConstituents) {
+  put<double>(JET_E, e);
+  put<double>(JET_PX, px);
+  put<double>(JET_PY, py);
+  put<double>(JET_PZ, pz);
+  put<double>(JET_M, m);
+  put<std::uint64_t>(JET_CONSTITUENT_BEGIN, _nConstituents);
+  for (unsigned n = 0; n < nConstituents; ++n) {
+    put<std::int32_t>(CONSTITUENT_INDEX, constituents[n]);
+  }
+  _nConstituents += nConstituents;
+  ++_nJets;
+}
+
+inline bool JetColumnWriter::close() {
+  if (_columns.empty() || !_columns[0].file) return false;
+
+  // the closing entries of the offset columns
+  put<std::uint64_t>(EVENT_JET_BEGIN, _nJets);
+  put<std::uint64_t>(JET_CONSTITUENT_BEGIN, _nConstituents);
+
+  // all values have to be there, otherwise the offsets do not match
+  bool ok = true;
+  for (unsigned i = 0; i < _columns.size(); ++i) {
+    ok = ok && fflush(_columns[i].file) == 0;
+  }
+  ok = ok && _columns[EVENT_JET_BEGIN].count == _nEvents + 1 && _columns[JET_CONSTITUENT_BEGIN].count == _nJets + 1
+    && _columns[JET_E].count == _nJets && _columns[CONSTITUENT_INDEX].count == _nConstituents;
+
+  // the header and column table, the data follows aligned
+  JetColumnFile::Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "MFJCOLS1", sizeof(header.magic));
+  header.version = JetColumnFile::FORMAT_VERSION;
+  header.nColumns = _columns.size();
+  header.nEvents = _nEvents;
+  header.nJets = _nJets;
+  header.nConstituents = _nConstituents;
+
+  std::vector<JetColumnFile::ColumnEntry> table(_columns.size());
+  std::uint64_t offset = sizeof(header) + table.size()*sizeof(JetColumnFile::ColumnEntry);
+  for (unsigned i = 0; i < _columns.size(); ++i) {
+    offset = (offset + JetColumnFile::ALIGNMENT - 1) / JetColumnFile::ALIGNMENT * JetColumnFile::ALIGNMENT;
+    memset(&table[i], 0, sizeof(table[i]));
+    strncpy(table[i].name, _columns[i].name.c_str(), JetColumnFile::NAME_SIZE - 1);
+    table[i].type = _columns[i].type;
+    table[i].elementSize = _columns[i].elementSize;
+    table[i].offset = offset;
+    table[i].count = _columns[i].count;
+    offset += _columns[i].count * _columns[i].elementSize;
+  }
+
+  const std::string partName = _fileName + ".part";
+  FILE* out = ok ? fopen(partName.c_str(), "wb") : NULL;
+  ok = out && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(&table[0], sizeof(table[0]), table.size(), out) == table.size();
+
+  std::vector<char> buffer(1 << 20);
+  for (unsigned i = 0; ok && i < _columns.size(); ++i) {
+    const long padding = table[i].offset - ftell(out);
+    static const char zeros[JetColumnFile::ALIGNMENT] = {};
+    ok = padding >= 0 && fwrite(zeros, 1, padding, out) == (size_t)padding && fseek(_columns[i].file, 0, SEEK_SET) == 0;
+    size_t n = 0;
+    while (ok && (n = fread(&buffer[0], 1, buffer.size(), _columns[i].file)) > 0) {
+      ok = fwrite(&buffer[0], 1, n, out) == n;
+    }
+  }
+  if (out) ok = (fclose(out) == 0) && ok;
+
+  for (unsigned i = 0; i < _columns.size(); ++i) {
+    fclose(_columns[i].file);
+    _columns[i].file = NULL;
+    remove(_columns[i].fileName.c_str());
+  }
+
+  if (ok) ok = rename(partName.c_str(), _fileName.c_str()) == 0;
+  if (!ok) remove(partName.c_str());
+  return ok;
+}
+
+inline bool JetColumnReader::open(const std::string& fileName) {
+  const int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(JetColumnFile::Header)) {
+    ::close(fd);
+    return false;
+  }
+  _size = st.st_size;
+  _data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (_data == MAP_FAILED) {
+    _data = NULL;
+    return false;
+  }
+
+  const JetColumnFile::Header& h = header();
+  const bool valid = memcmp(h.magic, "MFJCOLS1", sizeof(h.magic)) == 0 && h.version == JetColumnFile::FORMAT_VERSION
+    && sizeof(h) + h.nColumns*sizeof(JetColumnFile::ColumnEntry) <= _size;
+  _eventJetBegin = valid && validOffsets("event_jet_begin", h.nEvents, h.nJets)
+    && validOffsets("jet_constituent_begin", h.nJets, h.nConstituents) ? column<std::uint64_t>("event_jet_begin") : NULL;
+  if (!_eventJetBegin) {
+    munmap(_data, _size);
+    _data = NULL;
+    return false;
+  }
+  return true;
+}
+
+inline bool JetColumnReader::validOffsets(const std::string& name, std::uint64_t n, std::uint64_t total) const {
+  std::uint64_t count = 0;
+  const std::uint64_t* begin = column<std::uint64_t>(name, &count);
+  if (!begin || count != n + 1 || begin[0] != 0 || begin[n] != total) return false;
+  for (std::uint64_t i = 0; i < n; ++i) {
+    if (begin[i] > begin[i+1]) return false;
+  }
+  return true;
+}
+
+template <class T> inline const T* JetColumnReader::column(const std::string& name, std::uint64_t* count) const {
+  const JetColumnFile::ColumnEntry* table = reinterpret_cast<const JetColumnFile::ColumnEntry*>(static_cast<const char*>(_data) + sizeof(JetColumnFile::Header));
+  for (unsigned i = 0; i < header().nColumns; ++i) {
+    if (strncmp(table[i].name, name.c_str(), JetColumnFile::NAME_SIZE) != 0) continue;
+    if (table[i].type != JetColumnFile::typeCode((const T*)NULL) || table[i].elementSize != sizeof(T)
+	|| table[i].offset > _size || table[i].count > (_size - table[i].offset)/sizeof(T)) {
+      return NULL;
+    }
+    if (count) *count = table[i].count;
+    return reinterpret_cast<const T*>(static_cast<const char*>(_data) + table[i].offset);
+  }
+  return NULL;
+}
+
+#endif
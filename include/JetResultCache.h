@@ -0,0 +1,339 @@
+#ifndef JETRESULTCACHE_H
+#define JETRESULTCACHE_H 1
+
+#include <EVENT/LCCollection.h>
+#include <EVENT/LCParameters.h>
+#include <EVENT/ReconstructedParticle.h>
+#include "LCIOSTLTypes.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Persistent store of the jets of a processor, for reprocessing the same input with the same settings.
+ *
+ * The file starts with the configuration it was written with. Opening it with a different
+ * configuration (or with an older format) discards all records and starts a new cache. Each record
+ * holds the final jets of one event, the indices of their constituents in the input collection and
+ * the parameters of the jet collection (d and y values, areas, ...). Records are found by run
+ * number, event number and a hash of the content of the input collection, so changed input is not
+ * taken from the cache either. The index of all records is built when the file is opened, new
+ * records are appended. The file is in the byte order of the machine, it is meant as a local cache.
+ */
+class JetResultCache {
+
+public:
+  struct Record {
+    int run{0};
+    int event{0};
+    std::uint64_t inputHash{0};
+    bool skippedFixedNrJets{false};
+    bool skippedMaxIterations{false};
+    /// E, px, py, pz and mass of each jet
+    std::vector<double> jets{};
+    /// constituents of jet j are indices[begin[j]] up to indices[begin[j+1]-1]
+    EVENT::IntVec begin{};
+    EVENT::IntVec indices{};
+    /// the parameters of the jet collection
+    std::map<std::string, EVENT::IntVec> intParameters{};
+    std::map<std::string, EVENT::FloatVec> floatParameters{};
+    std::map<std::string, EVENT::StringVec> stringParameters{};
+
+    unsigned nJets() const { return jets.size()/5; }
+  };
+  typedef std::shared_ptr<Record> RecordPtr;
+
+  JetResultCache(): _file(NULL), _index(), _mutex(), _invalidated(false), _statsHits(0), _statsMisses(0), _statsStored(0) {}
+
+  ~JetResultCache() {
+    if (_file) fclose(_file);
+  }
+
+  /// open or create the cache file, false if it cannot be used
+  bool open(const std::string& fileName, const std::string& configuration);
+
+  /// the record of this event, or an empty pointer
+  RecordPtr find(int run, int event, std::uint64_t inputHash);
+
+  /// append the record, unless the event is stored already
+  void insert(const Record& record);
+
+  /// hash of everything in the input collection that goes into the jet finding
+  static std::uint64_t hashInput(EVENT::LCCollection* recCol);
+
+  /// copy the collection parameters into the record
+  static void getParameters(const EVENT::LCParameters& params, Record& record);
+
+  /// copy the record parameters to the collection
+  static void setParameters(const Record& record, EVENT::LCParameters& params);
+
+  /// the file had records of another configuration, which were dropped
+  bool invalidated() const { return _invalidated; }
+  unsigned size() const { return _index.size(); }
+  long statsHits() const { return _statsHits; }
+  long statsMisses() const { return _statsMisses; }
+  long statsStored() const { return _statsStored; }
+
+private:
+  JetResultCache(const JetResultCache&) = delete;
+  JetResultCache& operator=(const JetResultCache&) = delete;
+
+  static const std::uint32_t FORMAT_VERSION = 1;
+
+  typedef std::tuple<int, int, std::uint64_t> Key;
+
+  /// serialisation of the records into a byte buffer
+  template <class T> static void put(std::vector<char>& buffer, const T& value) {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+  static void put(std::vector<char>& buffer, const std::string& value) {
+    put(buffer, std::uint32_t(value.size()));
+    buffer.insert(buffer.end(), value.begin(), value.end());
+  }
+  template <class T> static void putVector(std::vector<char>& buffer, const std::vector<T>& values) {
+    put(buffer, std::uint32_t(values.size()));
+    for (unsigned i = 0; i < values.size(); ++i) put(buffer, values[i]);
+  }
+
+  /// reading it back, false if the buffer is too short
+  class Reader {
+  public:
+    Reader(const std::vector<char>& buffer): _buffer(buffer), _pos(0) {}
+    template <class T> bool get(T& value) {
+      if (_pos + sizeof(T) > _buffer.size()) return false;
+      memcpy(&value, &_buffer[_pos], sizeof(T));
+      _pos += sizeof(T);
+      return true;
+    }
+    bool get(std::string& value) {
+      std::uint32_t size;
+      if (!get(size) || _pos + size > _buffer.size()) return false;
+      value.assign(_buffer.begin() + _pos, _buffer.begin() + _pos + size);
+      _pos += size;
+      return true;
+    }
+    template <class T> bool getVector(std::vector<T>& values) {
+      std::uint32_t size;
+      if (!get(size)) return false;
+      values.resize(size);
+      for (unsigned i = 0; i < size; ++i) {
+	if (!get(values[i])) return false;
+      }
+      return true;
+    }
+  private:
+    const std::vector<char>& _buffer;
+    std::size_t _pos;
+  };
+
+  template <class T> static void putParameters(std::vector<char>& buffer, const std::map<std::string, T>& params) {
+    put(buffer, std::uint32_t(params.size()));
+    for (typename std::map<std::string, T>::const_iterator it = params.begin(); it != params.end(); ++it) {
+      put(buffer, it->first);
+      putVector(buffer, it->second);
+    }
+  }
+  template <class T> static bool getParameters(Reader& reader, std::map<std::string, T>& params) {
+    std::uint32_t size;
+    if (!reader.get(size)) return false;
+    for (unsigned i = 0; i < size; ++i) {
+      std::string key;
+      if (!reader.get(key) || !reader.getVector(params[key])) return false;
+    }
+    return true;
+  }
+
+  bool writeHeader(const std::string& configuration);
+  bool readRecord(long offset, Record& record);
+
+  FILE* _file;
+  std::map<Key, long> _index;
+  std::mutex _mutex;
+  bool _invalidated;
+  long _statsHits;
+  long _statsMisses;
+  long _statsStored;
+
+}; //end class JetResultCache
+
+
+inline bool JetResultCache::open(const std::string& fileName, const std::string& configuration) {
+
+  _file = fopen(fileName.c_str(), "r+b");
+  if (!_file) {
+    _file = fopen(fileName.c_str(), "w+b");
+    return _file && writeHeader(configuration);
+  }
+
+  // the header has to match exactly, otherwise the records are of no use
+  char magic[8];
+  std::uint32_t version = 0, configSize = 0;
+  bool valid = fread(magic, 1, sizeof(magic), _file) == sizeof(magic) && memcmp(magic, "MFJCACHE", sizeof(magic)) == 0
+    && fread(&version, sizeof(version), 1, _file) == 1 && version == FORMAT_VERSION
+    && fread(&configSize, sizeof(configSize), 1, _file) == 1 && configSize == configuration.size();
+  if (valid) {
+    std::string stored(configSize, ' ');
+    valid = (configSize == 0 || fread(&stored[0], 1, configSize, _file) == configSize) && stored == configuration;
+  }
+  if (!valid) {
+    fclose(_file);
+    _invalidated = true;
+    _file = fopen(fileName.c_str(), "w+b");
+    return _file && writeHeader(configuration);
+  }
+
+  // index the records, a record cut off at the end (e.g. by a crash) is removed
+  const long headerEnd = ftell(_file);
+  if (fseek(_file, 0, SEEK_END) != 0) return false;
+  const long fileSize = ftell(_file);
+  long start = headerEnd;
+  while (start < fileSize) {
+    std::uint32_t size = 0;
+    int run = 0, event = 0;
+    std::uint64_t inputHash = 0;
+    const bool complete = start + (long)sizeof(size) <= fileSize && fseek(_file, start, SEEK_SET) == 0
+      && fread(&size, sizeof(size), 1, _file) == 1 && start + (long)sizeof(size) + (long)size <= fileSize
+      && size >= sizeof(run) + sizeof(event) + sizeof(inputHash)
+      && fread(&run, sizeof(run), 1, _file) == 1 && fread(&event, sizeof(event), 1, _file) == 1
+      && fread(&inputHash, sizeof(inputHash), 1, _file) == 1;
+    if (!complete) {
+      fflush(_file);
+      if (ftruncate(fileno(_file), start) != 0) return false;
+      break;
+    }
+    _index[Key(run, event, inputHash)] = start + sizeof(size);
+    start += sizeof(size) + size;
+  }
+  return true;
+}
+
+inline bool JetResultCache::writeHeader(const std::string& configuration) {
+  const std::uint32_t version = FORMAT_VERSION, configSize = configuration.size();
+  const bool ok = fwrite("MFJCACHE", 1, 8, _file) == 8
+    && fwrite(&version, sizeof(version), 1, _file) == 1
+    && fwrite(&configSize, sizeof(configSize), 1, _file) == 1
+    && fwrite(configuration.data(), 1, configSize, _file) == configSize;
+  return ok && fflush(_file) == 0;
+}
+
+inline JetResultCache::RecordPtr JetResultCache::find(int run, int event, std::uint64_t inputHash) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::map<Key, long>::const_iterator it = _index.find(Key(run, event, inputHash));
+  RecordPtr record;
+  if (it != _index.end()) {
+    record = std::make_shared<Record>();
+    if (!readRecord(it->second, *record)) record.reset();
+  }
+  if (record) _statsHits++;
+  else _statsMisses++;
+  return record;
+}
+
+inline bool JetResultCache::readRecord(long offset, Record& record) {
+  std::uint32_t size = 0;
+  if (fseek(_file, offset - sizeof(size), SEEK_SET) != 0 || fread(&size, sizeof(size), 1, _file) != 1) return false;
+  std::vector<char> buffer(size);
+  if (size > 0 && fread(&buffer[0], 1, size, _file) != size) return false;
+
+  Reader reader(buffer);
+  std::uint8_t skippedFixedNrJets = 0, skippedMaxIterations = 0;
+  const bool ok = reader.get(record.run) && reader.get(record.event) && reader.get(record.inputHash)
+    && reader.get(skippedFixedNrJets) && reader.get(skippedMaxIterations)
+    && reader.getVector(record.jets) && reader.getVector(record.begin) && reader.getVector(record.indices)
+    && getParameters(reader, record.intParameters) && getParameters(reader, record.floatParameters)
+    && getParameters(reader, record.stringParameters);
+  record.skippedFixedNrJets = skippedFixedNrJets;
+  record.skippedMaxIterations = skippedMaxIterations;
+  return ok;
+}
+
+inline void JetResultCache::insert(const Record& record) {
+  std::vector<char> buffer;
+  put(buffer, record.run);
+  put(buffer, record.event);
+  put(buffer, record.inputHash);
+  put(buffer, std::uint8_t(record.skippedFixedNrJets));
+  put(buffer, std::uint8_t(record.skippedMaxIterations));
+  putVector(buffer, record.jets);
+  putVector(buffer, record.begin);
+  putVector(buffer, record.indices);
+  putParameters(buffer, record.intParameters);
+  putParameters(buffer, record.floatParameters);
+  putParameters(buffer, record.stringParameters);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  const Key key(record.run, record.event, record.inputHash);
+  if (_index.count(key)) return;
+
+  const std::uint32_t size = buffer.size();
+  if (fseek(_file, 0, SEEK_END) != 0) return;
+  const long start = ftell(_file);
+  if (fwrite(&size, sizeof(size), 1, _file) != 1 || fwrite(&buffer[0], 1, size, _file) != size || fflush(_file) != 0) {
+    // do not leave half a record behind, otherwise it is removed when the file is opened again
+    const int status = ftruncate(fileno(_file), start);
+    (void)status;
+    return;
+  }
+  _index[key] = start + sizeof(size);
+  _statsStored++;
+}
+
+inline std::uint64_t JetResultCache::hashInput(EVENT::LCCollection* recCol) {
+  // FNV-1a over the four-vectors, charges and types
+  std::uint64_t hash = 14695981039346656037ULL;
+  const auto add = [&hash](const void* data, std::size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+  };
+  const int nParticles = recCol->getNumberOfElements();
+  add(&nParticles, sizeof(nParticles));
+  for (int i = 0; i < nParticles; ++i) {
+    const EVENT::ReconstructedParticle* par = static_cast<const EVENT::ReconstructedParticle*>(recCol->getElementAt(i));
+    const double values[4] = {par->getMomentum()[0], par->getMomentum()[1], par->getMomentum()[2], par->getEnergy()};
+    const float charge = par->getCharge();
+    const int type = par->getType();
+    add(values, sizeof(values));
+    add(&charge, sizeof(charge));
+    add(&type, sizeof(type));
+  }
+  return hash;
+}
+
+inline void JetResultCache::getParameters(const EVENT::LCParameters& params, Record& record) {
+  EVENT::StringVec keys;
+  params.getIntKeys(keys);
+  for (unsigned k = 0; k < keys.size(); ++k) params.getIntVals(keys[k], record.intParameters[keys[k]]);
+  keys.clear();
+  params.getFloatKeys(keys);
+  for (unsigned k = 0; k < keys.size(); ++k) params.getFloatVals(keys[k], record.floatParameters[keys[k]]);
+  keys.clear();
+  params.getStringKeys(keys);
+  for (unsigned k = 0; k < keys.size(); ++k) params.getStringVals(keys[k], record.stringParameters[keys[k]]);
+}
+
+inline void JetResultCache::setParameters(const Record& record, EVENT::LCParameters& params) {
+  for (std::map<std::string, EVENT::IntVec>::const_iterator it = record.intParameters.begin(); it != record.intParameters.end(); ++it) {
+    params.setValues(it->first, it->second);
+  }
+  for (std::map<std::string, EVENT::FloatVec>::const_iterator it = record.floatParameters.begin(); it != record.floatParameters.end(); ++it) {
+    params.setValues(it->first, it->second);
+  }
+  for (std::map<std::string, EVENT::StringVec>::const_iterator it = record.stringParameters.begin(); it != record.stringParameters.end(); ++it) {
+    params.setValues(it->first, it->second);
+  }
+}
+
+#endif // JETRESULTCACHE_H
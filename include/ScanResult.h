@@ -0,0 +1,16 @@
+#ifndef SCANRESULT_H
+#define SCANRESULT_H 1
+
+#include <limits>
+#include <vector>
+
+/// the jets of one event for one point of the scanGrid of FastJetUtil
+struct ScanResult {
+  /// y_{n-1,n} and y_{n,n+1} of the n jets found, NaN in the inclusive mode or if they do not exist
+  float yNMinus1N{std::numeric_limits<float>::quiet_NaN()};
+  float yNNPlus1{std::numeric_limits<float>::quiet_NaN()};
+  /// E, px, py, pz and m of each jet
+  std::vector<double> jets{};
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef TRACERECORDER_H
+#define TRACERECORDER_H 1
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+/**
+ * Writes timed spans (conversion, clustering, output, ...) of single events to a file in the trace
+ * event format, which chrome://tracing, Perfetto and speedscope open. The processors writing to the
+ * same file share one recorder.
+ *
+ * Spans are recorded on the thread that does the work: a Scope sets the recorder of the calling
+ * thread for the event it handles, or NULL if the event is not sampled, and every Span created on
+ * that thread while the Scope exists goes to that recorder. Without a recorder a Span does nothing
+ * but check a pointer.
+ */
+class TraceRecorder {
+
+public:
+  typedef std::shared_ptr<TraceRecorder> Ptr;
+
+  /// the recorder of fileName, created on first use, NULL if the file cannot be written
+  static Ptr open(const std::string& fileName);
+
+  ~TraceRecorder() {
+    fputs("\n]\n", _file);
+    fclose(_file);
+  }
+
+  /// microseconds since the recorder was created
+  double now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _start).count();
+  }
+
+  /// one complete event, args is a JSON object body ("key": value, ...)
+  void write(const char* name, const char* category, double start, double duration, const std::string& args);
+
+  /// the recorder the spans of the calling thread go to
+  static TraceRecorder*& current() {
+    static thread_local TraceRecorder* recorder = NULL;
+    return recorder;
+  }
+
+  class Scope {
+  public:
+    explicit Scope(TraceRecorder* recorder): _previous(current()) { current() = recorder; }
+    ~Scope() { current() = _previous; }
+  private:
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    TraceRecorder* _previous;
+  };
+
+  class Span {
+  public:
+    Span(const char* name, const char* category): _recorder(current()), _name(name), _category(category),
+						 _start(_recorder ? _recorder->now() : 0.0), _args() {}
+    ~Span() {
+      if (_recorder) _recorder->write(_name, _category, _start, _recorder->now() - _start, _args.str());
+    }
+
+    bool active() const { return _recorder; }
+
+    template <class T> Span& arg(const char* key, const T& value) {
+      if (_recorder) {
+	if (_args.tellp() > 0) _args << ", ";
+	_args << "\"" << key << "\": " << value;
+      }
+      return *this;
+    }
+    Span& arg(const char* key, const std::string& value) {
+      if (_recorder) {
+	if (_args.tellp() > 0) _args << ", ";
+	_args << "\"" << key << "\": \"" << escape(value) << "\"";
+      }
+      return *this;
+    }
+    Span& arg(const char* key, const char* value) { return arg(key, std::string(value)); }
+
+  private:
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+    TraceRecorder* _recorder;
+    const char* _name;
+    const char* _category;
+    double _start;
+    std::ostringstream _args;
+  };
+
+private:
+  explicit TraceRecorder(FILE* file): _file(file), _start(std::chrono::steady_clock::now()), _mutex(), _threads(), _nEvents(0) {}
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+  static std::string escape(const std::string& value) {
+    std::string escaped;
+    for (unsigned i = 0; i < value.size(); ++i) {
+      if (value[i] == '"' || value[i] == '\\') escaped += '\\';
+      escaped += value[i];
+    }
+    return escaped;
+  }
+
+  FILE* _file;
+  const std::chrono::steady_clock::time_point _start;
+  std::mutex _mutex;
+  // small thread numbers for the viewer
+  std::map<std::thread::id, int> _threads;
+  long _nEvents;
+
+}; //end class TraceRecorder
+
+
+inline TraceRecorder::Ptr TraceRecorder::open(const std::string& fileName) {
+  static std::mutex registryMutex;
+  static std::map<std::string, std::weak_ptr<TraceRecorder> > registry;
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  Ptr recorder = registry[fileName].lock();
+  if (!recorder) {
+    FILE* file = fopen(fileName.c_str(), "w");
+    if (!file) return Ptr();
+    // the JSON array format, viewers also read it if the job ends before the closing bracket
+    fputs("[\n", file);
+    recorder = Ptr(new TraceRecorder(file));
+    registry[fileName] = recorder;
+  }
+  return recorder;
+}
+
+inline void TraceRecorder::write(const char* name, const char* category, double start, double duration, const std::string& args) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  const int tid = _threads.insert(std::make_pair(std::this_thread::get_id(), int(_threads.size()) + 1)).first->second;
+  fprintf(_file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {%s}}",
+	  _nEvents > 0 ? ",\n" : "", name, category, start, duration, int(getpid()), tid, args.c_str());
+  ++_nEvents;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef TRUTHGHOSTS_H
+#define TRUTHGHOSTS_H 1
+
+#include "LCIOSTLTypes.h"
+#include <EVENT/LCCollection.h>
+#include <EVENT/MCParticle.h>
+
+#include <fastjet/PseudoJet.hh>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+typedef std::vector< fastjet::PseudoJet > PseudoJetList;
+
+/**
+ * MC particles clustered together with the reconstructed particles as ghosts: their four-momenta are
+ * scaled down so far that they do not change the jets, but each of them ends up in the jet of its
+ * direction. The ghosts are the MC particles with one of the given generator statuses, and the
+ * weakly decaying b and c hadrons, which give the flavour of the jets (5 with a b hadron, else 4
+ * with a c hadron, else 0).
+ *
+ * The user_index of a ghost is -2 minus the index of its MC particle in the collection, below the -1
+ * of the ghosts of the FastJet jet areas.
+ */
+class TruthGhosts {
+
+public:
+  TruthGhosts(): _generatorStatuses(), _scale(1e-18) {}
+
+  void configure(const EVENT::IntVec& generatorStatuses, double scale) {
+    _generatorStatuses = generatorStatuses;
+    _scale = scale;
+  }
+
+  static bool isGhost(const fastjet::PseudoJet& pj) { return pj.user_index() <= -2; }
+  /// index of the MC particle of a ghost in its collection
+  static int mcIndex(const fastjet::PseudoJet& pj) { return -2 - pj.user_index(); }
+
+  /// 5 for b hadrons, 4 for c hadrons, 0 for everything else
+  static int heavyFlavour(int pdg) {
+    const int code = std::abs(pdg) % 10000;
+    // quarks, leptons, bosons and diquarks are no hadrons
+    if (code < 100 || (code / 10) % 10 == 0) return 0;
+    const int heaviest = std::max((code / 1000) % 10, std::max((code / 100) % 10, (code / 10) % 10));
+    return heaviest == 5 || heaviest == 4 ? heaviest : 0;
+  }
+
+  /// append the ghosts of the MC particles to pjList, returns their number
+  inline unsigned add(EVENT::LCCollection* mcCol, PseudoJetList& pjList) const;
+
+  /// the constituents without the ghosts, and the MC particles of the ghosts
+  static inline void split(const PseudoJetList& constituents, PseudoJetList& particles, EVENT::IntVec& mcIndices);
+
+  /// the flavour of a jet with the ghosts of these MC particles
+  static inline int flavour(EVENT::LCCollection* mcCol, const EVENT::IntVec& mcIndices);
+
+private:
+  inline bool selected(const EVENT::MCParticle* mc) const;
+
+  EVENT::IntVec _generatorStatuses;
+  double _scale;
+
+}; //end class TruthGhosts
+
+
+/// MC particles of the jets of one collection, stored like ConstituentIndexList: jet j has the
+/// MC particles TruthIndices[TruthBegin[j]] up to TruthIndices[TruthBegin[j+1]-1] and the flavour JetFlavour[j]
+class TruthAssociation {
+
+public:
+  TruthAssociation(): _begin(1, 0), _indices(), _flavours() {}
+
+  void add(const EVENT::IntVec& mcIndices, int flavour) {
+    _indices.insert(_indices.end(), mcIndices.begin(), mcIndices.end());
+    _begin.push_back(_indices.size());
+    _flavours.push_back(flavour);
+  }
+
+  void store(EVENT::LCCollection* jetCol, const std::string& mcName) const {
+    jetCol->parameters().setValues(std::string("TruthBegin"), _begin);
+    jetCol->parameters().setValues(std::string("TruthIndices"), _indices);
+    jetCol->parameters().setValues(std::string("JetFlavour"), _flavours);
+    jetCol->parameters().setValue(std::string("TruthCollection"), mcName);
+  }
+
+private:
+  EVENT::IntVec _begin;
+  EVENT::IntVec _indices;
+  EVENT::IntVec _flavours;
+};
+
+
+bool TruthGhosts::selected(const EVENT::MCParticle* mc) const {
+  if (std::find(_generatorStatuses.begin(), _generatorStatuses.end(), mc->getGeneratorStatus()) != _generatorStatuses.end()) {
+    return true;
+  }
+
+  // the last b or c hadron of its decay chain
+  const int heavy = heavyFlavour(mc->getPDG());
+  if (heavy == 0) return false;
+  const std::vector<EVENT::MCParticle*>& daughters = mc->getDaughters();
+  for (unsigned d = 0; d < daughters.size(); ++d) {
+    if (heavyFlavour(daughters[d]->getPDG()) == heavy) return false;
+  }
+  return true;
+}
+
+unsigned TruthGhosts::add(EVENT::LCCollection* mcCol, PseudoJetList& pjList) const {
+  const unsigned before = pjList.size();
+  for (int i = 0; i < mcCol->getNumberOfElements(); ++i) {
+    const EVENT::MCParticle* mc = static_cast<const EVENT::MCParticle*>(mcCol->getElementAt(i));
+    const double* mom = mc->getMomentum();
+    // a particle at rest has no direction to be clustered by
+    if ((mom[0] == 0 && mom[1] == 0 && mom[2] == 0) || !selected(mc)) continue;
+    pjList.push_back(fastjet::PseudoJet(_scale*mom[0], _scale*mom[1], _scale*mom[2], _scale*mc->getEnergy()));
+    pjList.back().set_user_index(-2 - i);
+  }
+  return pjList.size() - before;
+}
+
+void TruthGhosts::split(const PseudoJetList& constituents, PseudoJetList& particles, EVENT::IntVec& mcIndices) {
+  particles.clear();
+  mcIndices.clear();
+  for (unsigned n = 0; n < constituents.size(); ++n) {
+    if (isGhost(constituents[n])) mcIndices.push_back(mcIndex(constituents[n]));
+    else particles.push_back(constituents[n]);
+  }
+}
+
+int TruthGhosts::flavour(EVENT::LCCollection* mcCol, const EVENT::IntVec& mcIndices) {
+  int flavour = 0;
+  for (unsigned n = 0; n < mcIndices.size(); ++n) {
+    const EVENT::MCParticle* mc = static_cast<const EVENT::MCParticle*>(mcCol->getElementAt(mcIndices[n]));
+    flavour = std::max(flavour, heavyFlavour(mc->getPDG()));
+  }
+  return flavour;
+}
+
+#endif
@@ -7,6 +7,7 @@
  */
 
 #include "FastJetProcessor.h"
+#include "ClusteringHistory.h"
 #include "FastJetUtil.h"
 
 #include <IMPL/ReconstructedParticleImpl.h>
@@ -16,7 +17,12 @@
 #include <EVENT/ReconstructedParticle.h>
 #include <EVENT/MCParticle.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
 #include <sstream>
+#include <thread>
 
 FastJetProcessor aFastJetProcessor;
 
@@ -26,12 +32,29 @@ FastJetProcessor::FastJetProcessor() : Processor("FastJetProcessor"),
 				       _lcParticleInName(""),
 				       _lcParticleOutName(""),
 				       _lcJetOutName(""),
+				       _lcHistoryOutName(""),
 				       _statsFoundJets(0),
 				       _statsNrEvents(0),
 				       _statsNrSkippedEmptyEvents(0),
 				       _statsNrSkippedFixedNrJets(0),
 				       _statsNrSkippedMaxIterations(0),
+				       _statsNrBudgetFallbacks(0),
 				       _storeParticlesInJets(false),
+				       _jetCacheFileName(""),
+				       _jetCache(NULL),
+				       _jetColumnFileName(""),
+				       _jetColumns(NULL),
+				       _variationParameters(),
+				       _variations(),
+				       _statsVariationFoundJets(),
+				       _variationThreads(0),
+				       _truthGhostCollectionName(""),
+				       _truthGhostGeneratorStatuses(),
+				       _truthGhostScale(1e-18),
+				       _truthGhosts(),
+				       _statsTruthGhosts(0),
+				       _statsBJets(0),
+				       _statsCJets(0),
 				       _fju(new FastJetUtil())
 {
   _description = "Using the FastJet library to identify jets";
@@ -42,12 +65,60 @@ FastJetProcessor::FastJetProcessor() : Processor("FastJetProcessor"),
 
   registerOutputCollection(LCIO::RECONSTRUCTEDPARTICLE, "recParticleOut", "a list of all reconstructed particles used to make jets. If no value specified collection is not created", _lcParticleOutName, "");
 
+  registerOutputCollection(LCIO::LCGENERICOBJECT, "clusteringHistoryOut", "The merge history of the clustering (see ClusteringHistory.h), to get the jets for other nJets or yCut values later without reclustering. If no value specified collection is not created", _lcHistoryOutName, "");
+
   registerProcessorParameter(
 			     "storeParticlesInJets",
 			     "Store the list of particles that were clustered into jets in the recParticleOut collection",
 			     _storeParticlesInJets,
 			     false);
 
+  registerProcessorParameter(
+			     "softParticleEnergyThreshold",
+			     "Particles below this energy are not clustered but attached afterwards to the jet closest in angle (opening angle for e+e- algorithms, rapidity-phi distance otherwise, not the distance measure of the algorithm), the jet four-vectors include them. The d and y values only describe the clustering of the other particles. In ExclusiveNJets and InclusiveIterativeNJets mode events with fewer particles above the threshold than jets are clustered with all particles. 0 to cluster all particles",
+			     _fju->_softEnergyThreshold,
+			     double(0.0));
+
+  registerProcessorParameter(
+			     "jetCacheFile",
+			     "File to keep the jets of each event in. Events found there with the same input and settings are not clustered again, the output is restored from the file. The file is reset when the settings change. If no value specified no cache is used",
+			     _jetCacheFileName,
+			     std::string(""));
+
+  registerProcessorParameter(
+			     "jetColumnFile",
+			     "File to write the jets, y values and constituent indices of all events to, as columns that can be memory mapped without LCIO (see JetColumnFile.h). The file is written in end(). If no value specified no file is written",
+			     _jetColumnFileName,
+			     std::string(""));
+
+  registerProcessorParameter(
+			     "variations",
+			     "Systematic variations of the input, as groups of <name> <type> <value> with the types EnergyScale, NeutralHadronScale, PhotonScale, ChargedScale (value: the factor) and TrackSmearing (value: the relative width). The converted input of each event is varied and clustered again for each of them, the jets are written to the output collections with _<name> appended. If no value specified there are no variations",
+			     _variationParameters,
+			     EVENT::StringVec());
+
+  registerProcessorParameter(
+			     "variationThreads",
+			     "Number of threads clustering the variations of an event in parallel, 0 for one thread per variation",
+			     _variationThreads,
+			     int(0));
+
+  registerInputCollection(LCIO::MCPARTICLE, "truthGhostCollection", "MC particles clustered as ghosts of negligible energy together with the input. The jet collections get the parameters TruthBegin and TruthIndices (the indices of the MC particles in each jet, like ConstituentBegin and ConstituentIndices), JetFlavour (5 with a weakly decaying b hadron, else 4 with a c hadron, else 0) and TruthCollection. If no value specified no ghosts are added", _truthGhostCollectionName, std::string(""));
+
+  EVENT::IntVec defGhostStatuses;
+  defGhostStatuses.push_back(1);
+  registerProcessorParameter(
+			     "truthGhostGeneratorStatus",
+			     "The MC particles with these generator statuses are added as ghosts, the weakly decaying b and c hadrons are always added",
+			     _truthGhostGeneratorStatuses,
+			     defGhostStatuses);
+
+  registerProcessorParameter(
+			     "truthGhostScale",
+			     "The four-momenta of the MC particles are scaled by this factor for the ghosts",
+			     _truthGhostScale,
+			     double(1e-18));
+
 
   _fju->registerFastJetParameters( this );
 
@@ -59,18 +130,37 @@ FastJetProcessor::FastJetProcessor(const FastJetProcessor& rhs):
   _lcParticleInName(rhs._lcParticleInName),
   _lcParticleOutName(rhs._lcParticleOutName),
   _lcJetOutName(rhs._lcJetOutName),
+  _lcHistoryOutName(rhs._lcHistoryOutName),
   _statsFoundJets(rhs._statsFoundJets),
   _statsNrEvents(rhs._statsNrEvents),
   _statsNrSkippedEmptyEvents(rhs._statsNrSkippedEmptyEvents),
   _statsNrSkippedFixedNrJets(rhs._statsNrSkippedFixedNrJets),
   _statsNrSkippedMaxIterations(rhs._statsNrSkippedMaxIterations),
+  _statsNrBudgetFallbacks(rhs._statsNrBudgetFallbacks),
   _storeParticlesInJets(rhs._storeParticlesInJets),
+  _jetCacheFileName(rhs._jetCacheFileName),
+  _jetCache(NULL),
+  _jetColumnFileName(rhs._jetColumnFileName),
+  _jetColumns(NULL),
+  _variationParameters(rhs._variationParameters),
+  _variations(rhs._variations),
+  _statsVariationFoundJets(rhs._statsVariationFoundJets),
+  _variationThreads(rhs._variationThreads),
+  _truthGhostCollectionName(rhs._truthGhostCollectionName),
+  _truthGhostGeneratorStatuses(rhs._truthGhostGeneratorStatuses),
+  _truthGhostScale(rhs._truthGhostScale),
+  _truthGhosts(rhs._truthGhosts),
+  _statsTruthGhosts(rhs._statsTruthGhosts),
+  _statsBJets(rhs._statsBJets),
+  _statsCJets(rhs._statsCJets),
   _fju( new FastJetUtil(*rhs._fju) )
  {}
 //	FastJetProcessor& operator=(const FastJetProcessor&) {}
 
 
 FastJetProcessor::~FastJetProcessor() {
+  delete _jetColumns;
+  delete _jetCache;
   delete _fju;
 }
 
@@ -86,12 +176,99 @@ void FastJetProcessor::init()
   // parse the given steering parameters
   _fju->init();
   streamlog_out(MESSAGE) << "Jet Algorithm: " << _fju->_jetAlgo->description() << std::endl << std::endl;
+  _fju->initScan();
+
+  if (!_lcHistoryOutName.empty() && _fju->_clusterMode == OWN_inclusiveIteration) {
+    throw Exception("clusteringHistoryOut cannot be combined with InclusiveIterativeNJets, the jets are not found in the clustering of the history");
+  }
+
+  _variations.clear();
+  if (_variationParameters.size() % 3 != 0) {
+    throw Exception("Wrong Parameter(s) for variations. Expected:\n <parameter name=\"variations\" type=\"StringVec\"> <name> <type> <value> ... </parameter>");
+  }
+  for (unsigned i = 0; i < _variationParameters.size(); i += 3) {
+    InputVariation::Type type;
+    if (!InputVariation::typeFromName(_variationParameters[i+1], type)) {
+      throw Exception("Unknown variation type: " + _variationParameters[i+1]);
+    }
+    const double value = atof(_variationParameters[i+2].c_str());
+    if (value <= 0) {
+      throw Exception("The value of the variation " + _variationParameters[i] + " has to be positive");
+    }
+    for (unsigned v = 0; v < _variations.size(); ++v) {
+      if (_variations[v].name() == _variationParameters[i]) {
+	throw Exception("The variation " + _variationParameters[i] + " is given twice");
+      }
+    }
+    _variations.push_back(InputVariation(_variationParameters[i], type, value));
+    streamlog_out(MESSAGE) << "Variation: " << _variations.back().description() << std::endl;
+  }
+  _statsVariationFoundJets.assign(_variations.size(), 0);
+
+  if (!_truthGhostCollectionName.empty()) {
+    if (_truthGhostScale <= 0) {
+      throw Exception("truthGhostScale has to be positive");
+    }
+    if (!_lcHistoryOutName.empty()) {
+      throw Exception("truthGhostCollection cannot be combined with clusteringHistoryOut, the history would contain the ghosts");
+    }
+    if (_fju->_clusterMode == OWN_inclusiveIteration) {
+      throw Exception("truthGhostCollection cannot be combined with InclusiveIterativeNJets, the jets are not found in the clustering of the ghosts");
+    }
+    const EVENT::StringVec& algo = _fju->_jetAlgoNameAndParams;
+    if (algo[0] == "ee_genkt_algorithm" && algo.size() > 2 && atof(algo[2].c_str()) < 0) {
+      throw Exception("truthGhostCollection cannot be combined with ee_genkt p < 0, the ghost weights E^2p overflow and the ghosts stay jets of their own");
+    }
+    if (_fju->_shareClusterSequence) {
+      streamlog_out(WARNING) << "The clustering with the truth ghosts is not shared with other processors" << std::endl;
+    }
+    _truthGhosts.configure(_truthGhostGeneratorStatuses, _truthGhostScale);
+  }
+
+  delete _jetCache;
+  _jetCache = NULL;
+  if (!_jetCacheFileName.empty()) {
+    if (!_lcHistoryOutName.empty()) {
+      throw Exception("jetCacheFile cannot be combined with clusteringHistoryOut, the clustering history is not cached");
+    }
+    if (!_variations.empty()) {
+      throw Exception("jetCacheFile cannot be combined with variations, the jets of the variations are not cached");
+    }
+    if (!_fju->_scanPoints.empty()) {
+      throw Exception("jetCacheFile cannot be combined with scanGrid, the jets of the grid points are not cached");
+    }
+    if (!_truthGhostCollectionName.empty()) {
+      throw Exception("jetCacheFile cannot be combined with truthGhostCollection, the truth association is not cached");
+    }
+
+    const std::string fileName = FastJetUtil::shardFileName(_jetCacheFileName);
+    _jetCache = new JetResultCache();
+    if (!_jetCache->open(fileName, configuration())) {
+      throw Exception("Cannot open the jet cache file " + fileName);
+    }
+    streamlog_out(MESSAGE) << "Jet cache " << fileName << ": " << _jetCache->size() << " events"
+			   << (_jetCache->invalidated() ? ", the events of different settings were discarded" : "") << std::endl;
+  }
+
+  delete _jetColumns;
+  _jetColumns = NULL;
+  if (!_jetColumnFileName.empty()) {
+    const std::string fileName = FastJetUtil::shardFileName(_jetColumnFileName);
+    _jetColumns = new JetColumnWriter();
+    if (!_jetColumns->open(fileName)) {
+      throw Exception("Cannot create the temporary files of the jet column file " + fileName);
+    }
+  }
 
   _statsFoundJets = 0;
   _statsNrEvents = 0;
   _statsNrSkippedEmptyEvents = 0;
   _statsNrSkippedFixedNrJets = 0;
   _statsNrSkippedMaxIterations = 0;
+  _statsNrBudgetFallbacks = 0;
+  _statsTruthGhosts = 0;
+  _statsBJets = 0;
+  _statsCJets = 0;
 
 }
 
@@ -99,90 +276,276 @@ void FastJetProcessor::init()
  */
 void FastJetProcessor::processEvent(LCEvent * evt)
 {
+  EventJets ev;
+  ev.evt = evt;
+
+  TraceRecorder::Scope trace(_fju->traceRecorder(evt));
+  TraceRecorder::Span span("event", "event");
+  if (span.active()) span.arg("processor", name()).arg("run", evt->getRunNumber()).arg("event", evt->getEventNumber());
+
+  if (readInput(ev) && !ev.cached) {
+    if (_truthGhostCollectionName.empty()) {
+      // convert to pseudojet list and cluster, unless another processor did the same already
+      ev.clustering = _fju->getClusterSequence(evt, _lcParticleInName, ev.particleIn);
+    } else {
+      // nobody else clusters with the ghosts
+      convertInput(ev);
+      ev.clustering->cs = _fju->makeClusterSequence(ev.clustering->pjList);
+    }
+    findJets(ev);
+  }
+  findVariationJets(ev);
+  buildOutput(ev);
+  registerOutput(ev);
+}
 
-  LCCollection* particleIn(NULL);
-  try
-    {
-      // get the input collection if existent
-      particleIn = evt->getCollection(_lcParticleInName);
-      if (particleIn->getNumberOfElements() < 1) {
-	_statsNrSkippedEmptyEvents++;
-	throw DataNotAvailableException("Collection is there, but its empty!");
-      }
+bool FastJetProcessor::readInput(EventJets& ev)
+{
+  try {
+    // get the input collection if existent
+    ev.particleIn = ev.evt->getCollection(_lcParticleInName);
+  } catch (const DataNotAvailableException& e) {
+    if (const long n = _fju->_diagnostics.report("MissingCollection")) {
+      streamlog_out(WARNING) << e.what() << std::endl << "Skipping" << _fju->_diagnostics.note(n) << std::endl;
+    }
+    ev.skippedEmpty = true;
+    ev.missingInput = true;
+    return false;
+  }
 
+  if (ev.particleIn->getNumberOfElements() < 1) {
+    if (const long n = _fju->_diagnostics.report("EmptyCollection")) {
+      streamlog_out(WARNING) << "Collection is there, but its empty!" << std::endl << "Skipping" << _fju->_diagnostics.note(n) << std::endl;
+    }
+    ev.skippedEmpty = true;
+    return false;
+  }
+
+  if (!_truthGhostCollectionName.empty()) {
+    try {
+      ev.mcIn = ev.evt->getCollection(_truthGhostCollectionName);
     } catch (const DataNotAvailableException& e) {
-    streamlog_out(WARNING) << e.what() << std::endl << "Skipping" << std::endl;
+      if (const long n = _fju->_diagnostics.report("MissingTruthCollection")) {
+	streamlog_out(WARNING) << e.what() << std::endl << "Clustering without truth ghosts" << _fju->_diagnostics.note(n) << std::endl;
+      }
+    }
+  }
 
-    //create dummy empty collection only in case there are processor that need the presence of them in later stages
+  if (_jetCache) {
+    ev.inputHash = JetResultCache::hashInput(ev.particleIn);
+    ev.cached = _jetCache->find(ev.evt->getRunNumber(), ev.evt->getEventNumber(), ev.inputHash);
+  }
 
-    // create output collection and save every jet with its particles in it
-    IMPL::LCCollectionVec* lccJetsOut = new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    // create output collection and save every particle which contributes to a jet
+  return true;
+}
 
-    IMPL::LCCollectionVec* lccParticlesOut(NULL);
-    if (_storeParticlesInJets){
-      lccParticlesOut= new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-      lccParticlesOut->setSubset(true);
-    }
+void FastJetProcessor::convertInput(EventJets& ev)
+{
+  ev.clustering = std::make_shared<ClusterSequenceCache::Entry>();
+  _fju->convertInput(ev.particleIn, *ev.clustering);
+  if (ev.mcIn) {
+    ev.nTruthGhosts = _truthGhosts.add(ev.mcIn, ev.clustering->pjList);
+    _statsTruthGhosts += ev.nTruthGhosts;
+  }
+}
 
-    evt->addCollection(lccJetsOut, _lcJetOutName);
-    if (_storeParticlesInJets) evt->addCollection(lccParticlesOut, _lcParticleOutName);
+void FastJetProcessor::findJets(EventJets& ev)
+{
+  // skipped events are common in skims, so no exceptions here
+  ClusteringResult result;
+  _fju->findJets(ev.clustering->pjList, *ev.clustering->cs, result, ev.nTruthGhosts);
+  ev.jets.swap(result.jets);
+  ev.skippedFixedNrJets = result.status == ClusteringResult::SKIPPED_FIXED_NR_JETS;
+  ev.skippedMaxIterations = result.status == ClusteringResult::SKIPPED_MAX_ITERATIONS;
+  ev.budgetFallback = result.budgetFallback;
+
+  // the grid points see the same input as the nominal jets, without the ghosts
+  if (!ev.variation && !_fju->_scanPoints.empty()) {
+    if (ev.nTruthGhosts > 0) {
+      PseudoJetList particles(ev.clustering->pjList.begin(), ev.clustering->pjList.end() - ev.nTruthGhosts);
+      _fju->scanEvent(particles, ev.scan);
+    } else {
+      _fju->scanEvent(ev.clustering->pjList, ev.scan);
+    }
+  }
+}
 
+void FastJetProcessor::findVariationJets(EventJets& ev)
+{
+  // every variation gets its output collections, also for the skipped events
+  for (unsigned i = 0; i < _variations.size(); ++i) {
+    std::unique_ptr<EventJets> varied(new EventJets());
+    varied->evt = ev.evt;
+    varied->particleIn = ev.particleIn;
+    varied->mcIn = ev.mcIn;
+    varied->nTruthGhosts = ev.nTruthGhosts;
+    varied->skippedEmpty = ev.skippedEmpty;
+    varied->variation = &_variations[i];
+    ev.variations.push_back(std::move(varied));
+  }
+  if (_variations.empty() || !ev.clustering) {
+    return;
+  }
 
-    return ;
+  TraceRecorder::Span span("variations", "clustering");
+  if (span.active()) span.arg("variations", int(_variations.size())).arg("particles", ev.clustering->pjList.size());
+
+  // vary the converted input, hard and soft particles together so that each particle gets its own random number
+  const ClusterSequenceCache::Entry& nominal = *ev.clustering;
+  PseudoJetList input(nominal.pjList);
+  input.insert(input.end(), nominal.softList.begin(), nominal.softList.end());
+  for (unsigned i = 0; i < ev.variations.size(); ++i) {
+    ev.variations[i]->clustering = std::make_shared<ClusterSequenceCache::Entry>();
+    ClusterSequenceCache::Entry& entry = *ev.variations[i]->clustering;
+    PseudoJetList varied;
+    _variations[i].apply(input, nominal.particles, ev.evt->getRunNumber(), ev.evt->getEventNumber(), varied);
+    entry.pjList.assign(varied.begin(), varied.begin() + nominal.pjList.size());
+    entry.softList.assign(varied.begin() + nominal.pjList.size(), varied.end());
+    entry.particles = nominal.particles;
+    entry.rho = nominal.rho;
+    entry.sigma = nominal.sigma;
   }
 
-  // convert to pseudojet list
-  PseudoJetList pjList = _fju->convertFromRecParticle(particleIn);
+  // cluster the variations concurrently, thread t takes the variations t, t+nThreads, ...
+  const unsigned nThreads = _variationThreads > 0 ? std::min<unsigned>(_variationThreads, _variations.size()) : _variations.size();
+  std::vector<std::exception_ptr> errors(nThreads);
+  // streamlog is not thread safe, the warnings of the threads are written after the join
+  std::vector< std::vector<Diagnostics::Message> > messages(nThreads);
+  TraceRecorder* recorder = TraceRecorder::current();
+  auto cluster = [&](unsigned t) {
+    TraceRecorder::Scope trace(recorder);
+    Diagnostics::Capture capture(messages[t]);
+    try {
+      for (unsigned i = t; i < ev.variations.size(); i += nThreads) {
+	ClusterSequenceCache::Entry& entry = *ev.variations[i]->clustering;
+	entry.cs = _fju->makeClusterSequence(entry.pjList);
+	findJets(*ev.variations[i]);
+      }
+    } catch (...) {
+      errors[t] = std::current_exception();
+    }
+  };
 
-  PseudoJetList jets;
-  fastjet::ClusterSequence cs = fastjet::ClusterSequence(pjList, *_fju->_jetAlgo);
-  try {
-    jets = _fju->clusterJets(pjList, cs, particleIn);
-  } catch(const SkippedFixedNrJetException& e ) {
-    _statsNrSkippedFixedNrJets++;
-  } catch(const SkippedMaxIterationException& e ) {
-    jets = e._jets;
-    _statsNrSkippedMaxIterations++;
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < nThreads; ++t) {
+    threads.push_back(std::thread(cluster, t));
   }
+  cluster(0);
+  for (unsigned t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  for (unsigned t = 0; t < messages.size(); ++t) {
+    FastJetUtil::writeMessages(messages[t]);
+  }
+  for (unsigned t = 0; t < errors.size(); ++t) {
+    if (errors[t]) std::rethrow_exception(errors[t]);
+  }
+}
 
-
-  _statsNrEvents++;
-  _statsFoundJets += jets.size();
-  const unsigned nrJets = jets.size();
+void FastJetProcessor::buildOutput(EventJets& ev)
+{
+  for (unsigned i = 0; i < ev.variations.size(); ++i) {
+    buildOutput(*ev.variations[i]);
+  }
 
   // create output collection and save every jet with its particles in it
-  IMPL::LCCollectionVec* lccJetsOut = new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
+  ev.lccJetsOut = new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
   // create output collection and save every particle which contributes to a jet
-  IMPL::LCCollectionVec* lccParticlesOut(NULL);
   if (_storeParticlesInJets){
-    lccParticlesOut= new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    lccParticlesOut->setSubset(true);
+    ev.lccParticlesOut = new IMPL::LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
+    ev.lccParticlesOut->setSubset(true);
+  }
+  if (!_lcHistoryOutName.empty() && !ev.variation) {
+    ev.lccHistoryOut = new IMPL::LCCollectionVec(LCIO::LCGENERICOBJECT);
+  }
+
+  //create dummy empty collection only in case there are processor that need the presence of them in later stages
+  if (ev.skippedEmpty) {
+    return;
+  }
+
+  TraceRecorder::Span span("output", "output");
+  if (span.active()) span.arg("jets", ev.cached ? int(ev.cached->nJets()) : int(ev.jets.size())).arg("cached", int(bool(ev.cached)));
+
+  if (ev.cached) {
+    restoreOutput(ev);
+    return;
+  }
+
+  const fastjet::ClusterSequence& cs = *ev.clustering->cs;
+  const unsigned nrJets = ev.jets.size();
+
+  if (ev.lccHistoryOut) {
+    ev.lccHistoryOut->addElement( ClusteringHistory::create(cs) );
+    LCParametersImpl &lccHistoryParams((LCParametersImpl &)ev.lccHistoryOut->parameters());
+    lccHistoryParams.setValue(std::string("ClusteringAlgorithm"), _fju->_jetAlgo->description());
   }
 
-  PseudoJetList::iterator it;
+  // runs in a single thread, so the statistics need no locking
+  if (!ev.clustering->softList.empty()) {
+    _fju->attachSoftParticles(ev.jets, ev.clustering->softList, ev.softConstituents);
+  }
+
+  ConstituentIndexList constituentIndices;
+  TruthAssociation truth;
+  for (unsigned j = 0; j < nrJets; ++j) {
+    fastjet::PseudoJet jet = ev.jets[j];
+    PseudoJetList constituents = cs.constituents(ev.jets[j]);
+
+    // the ghosts only tell which MC particles belong to the jet, their momenta are negligible
+    if (ev.mcIn) {
+      PseudoJetList particles;
+      EVENT::IntVec mcIndices;
+      TruthGhosts::split(constituents, particles, mcIndices);
+      constituents.swap(particles);
+      const int flavour = TruthGhosts::flavour(ev.mcIn, mcIndices);
+      truth.add(mcIndices, flavour);
+      if (!ev.variation && flavour == 5) _statsBJets++;
+      if (!ev.variation && flavour == 4) _statsCJets++;
+    }
+
+    // add the soft particles that were not clustered
+    if (!ev.softConstituents.empty()) {
+      for (unsigned n = 0; n < ev.softConstituents[j].size(); ++n) {
+	jet += ev.softConstituents[j][n];
+	constituents.push_back(ev.softConstituents[j][n]);
+      }
+    }
+
+    if (_fju->_subtractBackground) {
+      _fju->subtractBackground(jet, ev.jets[j], cs, ev.clustering->rho);
+    }
 
-  for (it=jets.begin(); it != jets.end(); it++) {
     // create a reconstructed particle for this jet, and add all the containing particles to it
-    ReconstructedParticle* rec = _fju->convertFromPseudoJet( (*it), cs.constituents(*it), particleIn);
-    lccJetsOut->addElement( rec );
+    ReconstructedParticle* rec = _fju->convertFromPseudoJet(jet, constituents, ev.clustering->particles, &constituentIndices);
+    ev.lccJetsOut->addElement( rec );
+    // the cache and the column file need the constituents in any case
+    if ((_jetCache || _jetColumns) && !_fju->_constituentIndices) {
+      constituentIndices.add(constituents);
+    }
 
     if (_storeParticlesInJets) {
-      for (unsigned int n = 0; n < cs.constituents(*it).size(); ++n) {
-	ReconstructedParticle* p =
-	  static_cast<ReconstructedParticle*>(particleIn->getElementAt((cs.constituents(*it))[n].user_index()));
-	lccParticlesOut->addElement( p );
+      for (unsigned int n = 0; n < constituents.size(); ++n) {
+	ev.lccParticlesOut->addElement( ev.clustering->particles[constituents[n].user_index()] );
       }
     }
   }
 
-  evt->addCollection(lccJetsOut, _lcJetOutName);
-  if (_storeParticlesInJets) evt->addCollection(lccParticlesOut, _lcParticleOutName);
+  if (_fju->_constituentIndices) {
+    constituentIndices.store(ev.lccJetsOut, _lcParticleInName);
+  }
+  if (ev.mcIn) {
+    truth.store(ev.lccJetsOut, _truthGhostCollectionName);
+  }
+  ev.constituentBegin = constituentIndices.begin();
+  ev.constituentIndices = constituentIndices.indices();
+  _fju->storeJetAreas(ev.jets, cs, ev.lccJetsOut);
+  _fju->storeBackground(*ev.clustering, ev.lccJetsOut);
 
   // special case for the exclusive jet mode: we can save the transition y_cut value
-  if (_fju->_clusterMode == FJ_exclusive_nJets && jets.size() == _fju->_requestedNumberOfJets) {
+  if (_fju->_clusterMode == FJ_exclusive_nJets && nrJets == _fju->_requestedNumberOfJets) {
     // save the dcut value for this algorithm (although it might not be meaningful)
-    LCParametersImpl &lccJetParams((LCParametersImpl &)lccJetsOut->parameters());
+    LCParametersImpl &lccJetParams((LCParametersImpl &)ev.lccJetsOut->parameters());
 
     lccJetParams.setValue(std::string("d_{n-1,n}"), (float)cs.exclusive_dmerge(nrJets-1));
     lccJetParams.setValue(std::string("d_{n,n+1}"), (float)cs.exclusive_dmerge(nrJets));
@@ -190,6 +553,114 @@ void FastJetProcessor::processEvent(LCEvent * evt)
     lccJetParams.setValue(std::string("y_{n,n+1}"), (float)cs.exclusive_ymerge(nrJets));
   }
 
+  // the jets of the last iterations were found with the cheaper settings
+  if (ev.budgetFallback) {
+    ev.lccJetsOut->parameters().setValue(std::string("TimeBudgetFallback"), int(1));
+  }
+
+  if (_jetCache) {
+    JetResultCache::Record record;
+    record.run = ev.evt->getRunNumber();
+    record.event = ev.evt->getEventNumber();
+    record.inputHash = ev.inputHash;
+    record.skippedFixedNrJets = ev.skippedFixedNrJets;
+    record.skippedMaxIterations = ev.skippedMaxIterations;
+    for (int j = 0; j < ev.lccJetsOut->getNumberOfElements(); ++j) {
+      const ReconstructedParticle* rec = static_cast<const ReconstructedParticle*>(ev.lccJetsOut->getElementAt(j));
+      record.jets.push_back(rec->getEnergy());
+      record.jets.push_back(rec->getMomentum()[0]);
+      record.jets.push_back(rec->getMomentum()[1]);
+      record.jets.push_back(rec->getMomentum()[2]);
+      record.jets.push_back(rec->getMass());
+    }
+    record.begin = ev.constituentBegin;
+    record.indices = ev.constituentIndices;
+    JetResultCache::getParameters(ev.lccJetsOut->getParameters(), record);
+    _jetCache->insert(record);
+  }
+}
+
+void FastJetProcessor::restoreOutput(EventJets& ev)
+{
+  const JetResultCache::Record& record = *ev.cached;
+  ev.skippedFixedNrJets = record.skippedFixedNrJets;
+  ev.skippedMaxIterations = record.skippedMaxIterations;
+  ev.constituentBegin = record.begin;
+  ev.constituentIndices = record.indices;
+
+  for (unsigned j = 0; j < record.nJets(); ++j) {
+    IMPL::ReconstructedParticleImpl* rec = new IMPL::ReconstructedParticleImpl();
+    rec->setEnergy( record.jets[5*j] );
+    double mom[3] = {record.jets[5*j+1], record.jets[5*j+2], record.jets[5*j+3]};
+    rec->setMomentum( mom );
+    rec->setMass( record.jets[5*j+4] );
+
+    for (int n = record.begin[j]; n < record.begin[j+1]; ++n) {
+      ReconstructedParticle* particle = static_cast<ReconstructedParticle*>(ev.particleIn->getElementAt(record.indices[n]));
+      if (!_fju->_constituentIndices) rec->addParticle( particle );
+      if (_storeParticlesInJets) ev.lccParticlesOut->addElement( particle );
+    }
+    ev.lccJetsOut->addElement( rec );
+  }
+
+  // d and y values, constituent indices, areas and background of the original output
+  JetResultCache::setParameters(record, ev.lccJetsOut->parameters());
+  // the cached event went over the time budget when it was clustered
+  ev.budgetFallback = ev.lccJetsOut->parameters().getIntVal("TimeBudgetFallback") != 0;
+}
+
+void FastJetProcessor::registerOutput(EventJets& ev)
+{
+  // the variations only have their collections, the rest is about the nominal jets
+  if (ev.variation) {
+    const std::string suffix = "_" + ev.variation->name();
+    _statsVariationFoundJets[ev.variation - &_variations[0]] += ev.lccJetsOut->getNumberOfElements();
+    ev.evt->addCollection(ev.lccJetsOut, _lcJetOutName + suffix);
+    if (_storeParticlesInJets) ev.evt->addCollection(ev.lccParticlesOut, _lcParticleOutName + suffix);
+    return;
+  }
+
+  if (_fju->_diagnostics.tick()) {
+    streamlog_out(MESSAGE) << "Diagnostics: " << _fju->_diagnostics.summary() << std::endl;
+  }
+
+  if (ev.skippedEmpty) {
+    if (!ev.missingInput) _statsNrSkippedEmptyEvents++;
+  } else {
+    if (ev.skippedFixedNrJets) _statsNrSkippedFixedNrJets++;
+    if (ev.skippedMaxIterations) _statsNrSkippedMaxIterations++;
+    if (ev.budgetFallback) _statsNrBudgetFallbacks++;
+    _statsNrEvents++;
+    _statsFoundJets += ev.lccJetsOut->getNumberOfElements();
+  }
+
+  ev.evt->addCollection(ev.lccJetsOut, _lcJetOutName);
+  if (_storeParticlesInJets) ev.evt->addCollection(ev.lccParticlesOut, _lcParticleOutName);
+  if (ev.lccHistoryOut) ev.evt->addCollection(ev.lccHistoryOut, _lcHistoryOutName);
+  for (unsigned i = 0; i < ev.variations.size(); ++i) {
+    registerOutput(*ev.variations[i]);
+  }
+
+  // in the order of the events, empty events included
+  if (_jetColumns) {
+    EVENT::FloatVec yNMinus1N, yNNPlus1;
+    ev.lccJetsOut->getParameters().getFloatVals(std::string("y_{n-1,n}"), yNMinus1N);
+    ev.lccJetsOut->getParameters().getFloatVals(std::string("y_{n,n+1}"), yNNPlus1);
+    _jetColumns->addEvent(ev.evt->getRunNumber(), ev.evt->getEventNumber(),
+			  yNMinus1N.empty() ? std::numeric_limits<float>::quiet_NaN() : yNMinus1N[0],
+			  yNNPlus1.empty() ? std::numeric_limits<float>::quiet_NaN() : yNNPlus1[0]);
+    for (int j = 0; j < ev.lccJetsOut->getNumberOfElements(); ++j) {
+      const ReconstructedParticle* rec = static_cast<const ReconstructedParticle*>(ev.lccJetsOut->getElementAt(j));
+      const int begin = ev.constituentBegin[j];
+      _jetColumns->addJet(rec->getEnergy(), rec->getMomentum()[0], rec->getMomentum()[1], rec->getMomentum()[2], rec->getMass(),
+			  ev.constituentIndices.data() + begin, ev.constituentBegin[j+1] - begin);
+    }
+  }
+
+  // also in the order of the events, the skipped ones without jets
+  if (_fju->_scanColumns) {
+    _fju->writeScan(ev.evt->getRunNumber(), ev.evt->getEventNumber(), ev.scan);
+  }
 }
 
 /** Called after data processing for clean up.
@@ -204,4 +675,121 @@ void FastJetProcessor::end()
     << " - Skipped Search for Fixed Nr Jets (due to insufficient nr of particles):" << _statsNrSkippedFixedNrJets
     << std::endl;
 
+  if (_fju->_eventTimeBudget > 0) {
+    streamlog_out(MESSAGE)
+      << "Events over the time budget of " << _fju->_eventTimeBudget << " s, finished with the fallback settings: " << _statsNrBudgetFallbacks
+      << std::endl;
+  }
+
+  if (!_truthGhostCollectionName.empty()) {
+    streamlog_out(MESSAGE)
+      << "Truth ghosts: " << _statsTruthGhosts
+      << " (" << (double)_statsTruthGhosts/_statsNrEvents << " per event)"
+      << " - b jets: " << _statsBJets
+      << " - c jets: " << _statsCJets
+      << std::endl;
+  }
+
+  for (unsigned i = 0; i < _variations.size(); ++i) {
+    streamlog_out(MESSAGE)
+      << "Variation " << _variations[i].description() << ": found jets: " << _statsVariationFoundJets[i]
+      << " (" << (double)_statsVariationFoundJets[i]/_statsNrEvents << " per event)"
+      << std::endl;
+  }
+
+  if (_fju->_shareClusterSequence) {
+    streamlog_out(MESSAGE)
+      << "ClusterSequence cache hits: " << _fju->_statsCacheHits
+      << " - misses: " << _fju->_statsCacheMisses
+      << std::endl;
+  }
+
+  if (_fju->_inputSelection) {
+    streamlog_out(MESSAGE)
+      << "Input particles: " << _fju->_statsInputParticles
+      << " - selected for clustering: " << _fju->_statsSelectedParticles
+      << " (" << (_fju->_statsInputParticles > 0 ? 100.0*_fju->_statsSelectedParticles/_fju->_statsInputParticles : 0.0) << "%)"
+      << std::endl;
+  }
+
+  if (_fju->_softEnergyThreshold > 0) {
+    streamlog_out(MESSAGE)
+      << "Soft particles not clustered: " << _fju->_statsSoftParticles
+      << " - attached to jets afterwards: " << _fju->_statsAttachedSoftParticles
+      << std::endl;
+  }
+
+  if (_fju->_backgroundEstimation) {
+    streamlog_out(MESSAGE)
+      << "Average background density rho: " << (_fju->_statsRhoEvents > 0 ? _fju->_statsRhoSum/_fju->_statsRhoEvents : 0.0)
+      << std::endl;
+  }
+
+  if (_jetColumns) {
+    if (!_jetColumns->close()) {
+      streamlog_out(ERROR) << "Could not write the jet column file " << _jetColumns->fileName() << std::endl;
+    } else {
+      streamlog_out(MESSAGE) << "Jet column file " << _jetColumns->fileName() << ": " << _jetColumns->nEvents() << " events, "
+			     << _jetColumns->nJets() << " jets" << std::endl;
+    }
+    delete _jetColumns;
+    _jetColumns = NULL;
+  }
+
+  if (_jetCache) {
+    streamlog_out(MESSAGE)
+      << "Jet cache: " << _jetCache->statsHits() << " events restored"
+      << " - " << _jetCache->statsMisses() << " clustered"
+      << " - " << _jetCache->statsStored() << " stored"
+      << std::endl;
+  }
+
+  _fju->endScan();
+
+  _fju->printTimingSummary();
+
+  streamlog_out(MESSAGE) << "Diagnostics: " << _fju->_diagnostics.summary() << std::endl;
+
+  // the sharded runner (MarlinFastJetShards) adds up the statistics of its workers
+  const char* statisticsFile = getenv("MARLINFASTJET_STATISTICS");
+  if (statisticsFile) {
+    writeStatistics(statisticsFile);
+  }
+}
+
+std::string FastJetProcessor::configuration() const
+{
+  std::ostringstream configuration;
+  configuration << _fju->clusteringKey(_lcParticleInName);
+  for (unsigned i = 0; i < _fju->_clusterModeNameAndParam.size(); ++i) {
+    configuration << "|" << _fju->_clusterModeNameAndParam[i];
+  }
+  configuration << "|subtract " << _fju->_subtractBackground << "|indices " << _fju->_constituentIndices;
+  if (_fju->_eventTimeBudget > 0) {
+    configuration << "|budget " << _fju->_eventTimeBudget << " " << _fju->_fallbackMaxIterations
+		  << " " << _fju->_fallbackInputMinE << " " << _fju->_fallbackStrategyName;
+  }
+  for (unsigned i = 0; i < _variations.size(); ++i) {
+    configuration << "|variation " << _variations[i].description();
+  }
+  return configuration.str();
+}
+
+void FastJetProcessor::writeStatistics(const std::string& fileName) const
+{
+  // one block per processor, several processors of a job append to the same file
+  std::ofstream out(fileName.c_str(), std::ios::app);
+  out << "processor " << name() << "\n"
+      << "configuration " << configuration() << "\n"
+      << "FoundJets " << _statsFoundJets << "\n"
+      << "Events " << _statsNrEvents << "\n"
+      << "SkippedEmptyEvents " << _statsNrSkippedEmptyEvents << "\n"
+      << "SkippedFixedNrJets " << _statsNrSkippedFixedNrJets << "\n"
+      << "SkippedMaxIterations " << _statsNrSkippedMaxIterations << "\n"
+      << "BudgetFallbacks " << _statsNrBudgetFallbacks << "\n";
+  _fju->writeStatistics(out);
+  out << "end" << std::endl;
+  if (!out) {
+    streamlog_out(ERROR) << "Could not write the statistics to " << fileName << std::endl;
+  }
 }
@@ -28,7 +28,9 @@ FastJetTopTagger::FastJetTopTagger() : Processor("FastJetTopTagger"),
 				       _statsNrSkippedEmptyEvents(0),
 				       _statsNrSkippedFixedNrJets(0),
 				       _statsNrSkippedMaxIterations(0),
+				       _statsNrBudgetFallbacks(0),
 				       _storeParticlesInJets(false),
+				       _sparseOutput(false),
 				       _fju(new FastJetUtil()),
 				       _doSubstructure(false),
 				       _energyCorrelator(""),
@@ -37,7 +39,12 @@ FastJetTopTagger::FastJetTopTagger() : Processor("FastJetTopTagger"),
 				       _deltaP(0.),
 				       _deltaR(0.),
 				       _cos_theta_W_max(0.),
-				       _jhtoptagger(fastjet::JHTopTagger()),
+				       _additionalWorkingPoints(),
+				       _jhtoptaggers(),
+				       _taggerDeltaP(),
+				       _taggerDeltaR(),
+				       _taggerCosThetaWMax(),
+				       _statsTaggedJets(),
 				       _energyCorrMeasureMap(),
 				       _maxECF(0),
 				       _energyCorrMap(),
@@ -67,6 +74,11 @@ FastJetTopTagger::FastJetTopTagger() : Processor("FastJetTopTagger"),
 			     "Store the list of particles that were clustered into jets in the recParticleOut collection",
 			     _storeParticlesInJets,
 			     false);
+
+  registerProcessorParameter("sparseOutput",
+			     "Only write the jets with a top candidate to the top tagger collections, instead of an empty particle for every other jet. The index of the jet each candidate belongs to is stored in the collection parameter ParentJetIndex. Events without input particles get no top tagger collections",
+			     _sparseOutput,
+			     false);
   
   //Fastjet parameters
   _fju->registerFastJetParameters( this );
@@ -102,6 +114,10 @@ FastJetTopTagger::FastJetTopTagger() : Processor("FastJetTopTagger"),
 			     "The maximal allowed value of the W helicity angle",
 			     _cos_theta_W_max,
 			     1.0);
+  registerProcessorParameter("additionalWorkingPoints",
+			     "Further working points of the top tagger as triplets of deltaP, deltaR and cos_theta_W_max. Every working point is evaluated on the same jets, the results of the i-th one are stored in the top tagger collections with the suffix _wp<i>. The jets are clustered once, and a prefilter shared by all working points skips the jets without a first hard splitting; every other jet still runs the full top tagger once per working point",
+			     _additionalWorkingPoints,
+			     EVENT::FloatVec());
 }
 
 FastJetTopTagger::~FastJetTopTagger(){
@@ -120,9 +136,23 @@ void FastJetTopTagger::init()
   _fju->init();
   streamlog_out(MESSAGE) << "Jet Algorithm: " << _fju->_jetAlgo->description() << std::endl << std::endl;
   
-  // initate the top tagger
-  _jhtoptagger = fastjet::JHTopTagger(_deltaP, _deltaR, _cos_theta_W_max);
-  streamlog_out(MESSAGE) << "Top tagger implementation: " << _jhtoptagger.description() << std::endl;
+  // initate the top taggers, one per working point
+  if (_additionalWorkingPoints.size() % 3 != 0) {
+    throw Exception("additionalWorkingPoints must be given as triplets of deltaP, deltaR and cos_theta_W_max");
+  }
+  _taggerDeltaP.assign(1, _deltaP);
+  _taggerDeltaR.assign(1, _deltaR);
+  _taggerCosThetaWMax.assign(1, _cos_theta_W_max);
+  for (unsigned i = 0; i < _additionalWorkingPoints.size(); i += 3) {
+    _taggerDeltaP.push_back(_additionalWorkingPoints[i]);
+    _taggerDeltaR.push_back(_additionalWorkingPoints[i+1]);
+    _taggerCosThetaWMax.push_back(_additionalWorkingPoints[i+2]);
+  }
+  _jhtoptaggers.clear();
+  for (unsigned wp = 0; wp < _taggerDeltaP.size(); ++wp) {
+    _jhtoptaggers.push_back(fastjet::JHTopTagger(_taggerDeltaP[wp], _taggerDeltaR[wp], _taggerCosThetaWMax[wp]));
+    streamlog_out(MESSAGE) << "Top tagger implementation (" << taggerOutputName(wp) << "): " << _jhtoptaggers[wp].description() << std::endl;
+  }
   //_jhtoptagger.set_top_selector(fastjet::SelectorMassRange(145, 205)); //<--Not used here, can be set in analysis
   //_jhtoptagger.set_W_selector(fastjet::SelectorMassRange(65, 95)); //<--Not used here, can be set in analysis
 
@@ -151,24 +181,142 @@ void FastJetTopTagger::init()
   _statsNrSkippedEmptyEvents = 0;
   _statsNrSkippedFixedNrJets = 0;
   _statsNrSkippedMaxIterations = 0;
+  _statsNrBudgetFallbacks = 0;
+  _statsTaggedJets.assign(_jhtoptaggers.size(), 0);
 
 } // end init
 
+struct FastJetTopTagger::TaggerOutput {
+  TaggerOutput() : top(new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE)),
+		   W(new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE)),
+		   W1(new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE)),
+		   W2(new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE)),
+		   nonW(new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE)),
+		   cosThetaW(new LCCollectionVec(LCIO::LCGENERICOBJECT)),
+		   cosThetaWValues(NULL),
+		   topIndices(), WIndices(), W1Indices(), W2Indices(), nonWIndices(),
+		   parentJetIndices() {}
+
+  LCCollectionVec* top;
+  LCCollectionVec* W;
+  LCCollectionVec* W1;
+  LCCollectionVec* W2;
+  LCCollectionVec* nonW;
+  LCCollectionVec* cosThetaW;
+  LCGenericObjectImpl* cosThetaWValues;
+
+  // constituents of the candidates, if they are stored as indices
+  ConstituentIndexList topIndices, WIndices, W1Indices, W2Indices, nonWIndices;
+
+  // jet of each candidate for the sparse output, the candidates are counted separately
+  EVENT::IntVec parentJetIndices;
+};
+
+std::string FastJetTopTagger::taggerOutputName(unsigned workingPoint) const {
+  if (workingPoint == 0) return _lcTopTaggerOutName;
+  std::ostringstream name;
+  name << _lcTopTaggerOutName << "_wp" << workingPoint;
+  return name.str();
+}
+
+void FastJetTopTagger::addTaggerOutput(LCEvent* evt, TaggerOutput& out, unsigned workingPoint) const {
+  if (_fju->_constituentIndices) {
+    out.topIndices.store(out.top, _lcParticleInName);
+    out.WIndices.store(out.W, _lcParticleInName);
+    out.W1Indices.store(out.W1, _lcParticleInName);
+    out.W2Indices.store(out.W2, _lcParticleInName);
+    out.nonWIndices.store(out.nonW, _lcParticleInName);
+  }
+  if (_sparseOutput) {
+    LCCollection* candidateCollections[] = {out.top, out.W, out.W1, out.W2, out.nonW, out.cosThetaW};
+    for (unsigned c = 0; c < sizeof(candidateCollections)/sizeof(candidateCollections[0]); ++c) {
+      candidateCollections[c]->parameters().setValues(std::string("ParentJetIndex"), out.parentJetIndices);
+    }
+  }
+
+  EVENT::FloatVec workingPointParams;
+  workingPointParams.push_back(_taggerDeltaP[workingPoint]);
+  workingPointParams.push_back(_taggerDeltaR[workingPoint]);
+  workingPointParams.push_back(_taggerCosThetaWMax[workingPoint]);
+  out.top->parameters().setValues(std::string("WorkingPoint"), workingPointParams);
+
+  const std::string name = taggerOutputName(workingPoint);
+  evt->addCollection(out.top, name);
+  evt->addCollection(out.W, name+"_W");
+  evt->addCollection(out.nonW, name+"_nonW");
+  evt->addCollection(out.W1, name+"_W1");
+  evt->addCollection(out.W2, name+"_W2");
+
+  if (out.cosThetaWValues) out.cosThetaW->addElement(out.cosThetaWValues);
+  evt->addCollection(out.cosThetaW, name+"_cos_theta_W");
+}
+
+/** Prefilter for the working points: follow the harder branch of the jet's
+ *  clustering history the way the JHTopTagger looks for its first hard
+ *  splitting, and keep the pt of both branches and their distance for every
+ *  step. This repeats the private JHTopTagger::_split_once of FastJet 3 and
+ *  has to be kept in line with it when FastJet changes.
+ */
+void FastJetTopTagger::findSplits(const fastjet::PseudoJet& jet, std::vector<Split>& splits) const {
+  splits.clear();
+  fastjet::PseudoJet thisJet = jet;
+  fastjet::PseudoJet p1, p2;
+  while (thisJet.has_parents(p1, p2)) {
+    if (p2.perp2() > p1.perp2()) std::swap(p1, p2);
+    Split split;
+    split.pt1 = p1.perp();
+    split.pt2 = p2.perp();
+    split.distance = std::abs(p2.rap() - p1.rap()) + std::abs(p2.delta_phi_to(p1));
+    splits.push_back(split);
+    thisJet = p1;
+  }
+}
+
+/** Whether the jet splits into two hard subjets at the given working point.
+ *  Without this first splitting the JHTopTagger cannot tag the jet, with it
+ *  the JHTopTagger of the working point decides.
+ */
+bool FastJetTopTagger::splitsOnce(const std::vector<Split>& splits, double refPt, unsigned workingPoint) const {
+  const double minPt = _taggerDeltaP[workingPoint]*refPt;
+  for (unsigned i = 0; i < splits.size(); ++i) {
+    if (splits[i].pt1 < minPt) return false;
+    if (splits[i].distance < _taggerDeltaR[workingPoint]) return false;
+    if (splits[i].pt2 >= minPt) return true;
+  }
+  return false;
+}
+
 /** Called for every event - the working horse.
  */
 void FastJetTopTagger::processEvent(LCEvent * evt){
-	
+
+  if (_fju->_diagnostics.tick()) {
+    streamlog_out(MESSAGE) << "Diagnostics: " << _fju->_diagnostics.summary() << std::endl;
+  }
+
+  TraceRecorder::Scope trace(_fju->traceRecorder(evt));
+  TraceRecorder::Span span("event", "event");
+  if (span.active()) span.arg("processor", name()).arg("run", evt->getRunNumber()).arg("event", evt->getEventNumber());
+
   LCCollection* particleIn(NULL);
   try {
     // get the input collection if existent
     particleIn = evt->getCollection(_lcParticleInName);
-    if (particleIn->getNumberOfElements() < 1){
-      _statsNrSkippedEmptyEvents++;
-      throw DataNotAvailableException("Collection is there, but its empty!");
-    }
-    
   } catch (DataNotAvailableException& e) {
-    streamlog_out(WARNING) << e.what() << std::endl << "Skipping" << std::endl;
+    if (const long n = _fju->_diagnostics.report("MissingCollection")) {
+      streamlog_out(WARNING) << e.what() << std::endl << "Skipping" << _fju->_diagnostics.note(n) << std::endl;
+    }
+    particleIn = NULL;
+  }
+
+  if (particleIn && particleIn->getNumberOfElements() < 1) {
+    _statsNrSkippedEmptyEvents++;
+    if (const long n = _fju->_diagnostics.report("EmptyCollection")) {
+      streamlog_out(WARNING) << "Collection is there, but its empty!" << std::endl << "Skipping" << _fju->_diagnostics.note(n) << std::endl;
+    }
+  }
+
+  if (!particleIn || particleIn->getNumberOfElements() < 1) {
 
     //create dummy empty collection only in case there are processor that need the presence of them in later stages
 
@@ -185,39 +333,35 @@ void FastJetTopTagger::processEvent(LCEvent * evt){
     evt->addCollection(lccJetsOut, _lcJetOutName);
     if (_storeParticlesInJets) evt->addCollection(lccParticlesOut, _lcParticleOutName);
 
-    //create output collection for the top jets
-    LCCollectionVec* lccTopTaggerOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    LCCollectionVec* lccTopTaggerWOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    LCCollectionVec* lccTopTaggerW1Out = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    LCCollectionVec* lccTopTaggerW2Out = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    LCCollectionVec* lccTopTaggernonWOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-    LCCollectionVec* lccTopTaggerCosThetaW = new LCCollectionVec(LCIO::LCGENERICOBJECT);
-    
-    evt->addCollection(lccTopTaggerOut, _lcTopTaggerOutName);
-    evt->addCollection(lccTopTaggerWOut, _lcTopTaggerOutName+"_W");
-    evt->addCollection(lccTopTaggernonWOut, _lcTopTaggerOutName+"_nonW");
-    evt->addCollection(lccTopTaggerW1Out, _lcTopTaggerOutName+"_W1");
-    evt->addCollection(lccTopTaggerW2Out, _lcTopTaggerOutName+"_W2");
-    evt->addCollection(lccTopTaggerCosThetaW, _lcTopTaggerOutName+"_cos_theta_W");
+    // there are no candidates to store
+    if (_sparseOutput) return;
+
+    //create output collections for the top jets of every working point
+    for (unsigned wp = 0; wp < _jhtoptaggers.size(); ++wp) {
+      TaggerOutput out;
+      addTaggerOutput(evt, out, wp);
+    }
     
     return;
   }
   
-  // convert to pseudojet list
-  PseudoJetList pjList = _fju->convertFromRecParticle(particleIn);
+  // convert to pseudojet list and cluster, unless another processor did the same already
+  ClusterSequenceCache::EntryPtr clustering = _fju->getClusterSequence(evt, _lcParticleInName, particleIn);
+  PseudoJetList& pjList = clustering->pjList;
+  fastjet::ClusterSequence& cs = *clustering->cs;
+  const ParticleTable& particles = clustering->particles;
   
   //Jet finding
-  PseudoJetList jets;
-  fastjet::ClusterSequence cs = fastjet::ClusterSequence(pjList, *_fju->_jetAlgo);
-  try {
-    // sort jets according to pt
-    jets = sorted_by_pt(_fju->clusterJets(pjList, cs, particleIn));
-  } catch(SkippedFixedNrJetException& e){
-    _statsNrSkippedFixedNrJets++; 
-  } catch( SkippedMaxIterationException& e ) {
-    jets = e._jets;
-    _statsNrSkippedMaxIterations++; 
+  ClusteringResult result;
+  _fju->findJets(pjList, cs, result);
+  if (result.status == ClusteringResult::SKIPPED_FIXED_NR_JETS) {
+    _statsNrSkippedFixedNrJets++;
+  } else if (result.status == ClusteringResult::SKIPPED_MAX_ITERATIONS) {
+    _statsNrSkippedMaxIterations++;
   }
+  if (result.budgetFallback) _statsNrBudgetFallbacks++;
+  // sort jets according to pt, unless the iterations did not converge
+  PseudoJetList jets = result.status == ClusteringResult::OK ? sorted_by_pt(result.jets) : result.jets;
 
   _statsNrEvents++;
   _statsFoundJets += jets.size();
@@ -233,16 +377,12 @@ void FastJetTopTagger::processEvent(LCEvent * evt){
     lccParticlesOut->setSubset(true);
   }
 
-  //Save TopTagger info of the jets into the lcio stream
-  LCCollectionVec* lccTopTaggerOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-  LCCollectionVec* lccTopTaggerWOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-  LCCollectionVec* lccTopTaggerW1Out = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-  LCCollectionVec* lccTopTaggerW2Out = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-  LCCollectionVec* lccTopTaggernonWOut = new LCCollectionVec(LCIO::RECONSTRUCTEDPARTICLE);
-  
-  //Save helicity information
-  LCCollectionVec* lccTopTaggerCosThetaW = new LCCollectionVec(LCIO::LCGENERICOBJECT);
-  LCGenericObjectImpl* lcgTopTaggerCosThetaW = new LCGenericObjectImpl(0, 0, 2);
+  //Save TopTagger info of the jets into the lcio stream, side by side for all working points
+  std::vector<TaggerOutput> taggerOutputs(_jhtoptaggers.size());
+  for (unsigned wp = 0; wp < taggerOutputs.size(); ++wp) {
+    //Save helicity information
+    taggerOutputs[wp].cosThetaWValues = new LCGenericObjectImpl(0, 0, 2);
+  }
   
   //Save substructure functions
   LCCollectionVec* lccSubStructure = new LCCollectionVec(LCIO::LCGENERICOBJECT);
@@ -269,19 +409,33 @@ void FastJetTopTagger::processEvent(LCEvent * evt){
   fastjet::contrib::Nsubjettiness nSubJettiness2(2, axMode, measMode);
   fastjet::contrib::Nsubjettiness nSubJettiness3(3, axMode, measMode);
   
+  // constituents of the jets, if they are stored as indices
+  ConstituentIndexList jetIndices;
+
+  // declustering of the current jet, shared by all working points
+  std::vector<Split> splits;
+
   //Loop over jets
   int index = 0;  
   PseudoJetList::iterator it;
   for(it=jets.begin(); it != jets.end(); it++, index++) {
     
+    TraceRecorder::Span jetSpan("substructure", "substructure");
+    if (jetSpan.active()) jetSpan.arg("jet", index).arg("constituents", it->constituents().size()).arg("workingPoints", _jhtoptaggers.size());
+
+    fastjet::PseudoJet jet = *it;
+    if (_fju->_subtractBackground) {
+      _fju->subtractBackground(jet, *it, cs, clustering->rho);
+    }
+
     // create a reconstructed particle for this jet, and add all the containing particles to it
-    ReconstructedParticle* rec = _fju->convertFromPseudoJet((*it), cs.constituents(*it), particleIn);
+    const PseudoJetList constituents = cs.constituents(*it);
+    ReconstructedParticle* rec = _fju->convertFromPseudoJet(jet, constituents, particles, &jetIndices);
     lccJetsOut->addElement( rec );
     
     if (_storeParticlesInJets) {
-      for (unsigned int n = 0; n < cs.constituents(*it).size(); ++n){
-	ReconstructedParticle* p = static_cast<ReconstructedParticle*>(particleIn->getElementAt((cs.constituents(*it))[n].user_index()));
-        lccParticlesOut->addElement(p); 
+      for (unsigned int n = 0; n < constituents.size(); ++n){
+        lccParticlesOut->addElement(particles[constituents[n].user_index()]); 
       }
     }
 
@@ -305,51 +459,83 @@ void FastJetTopTagger::processEvent(LCEvent * evt){
     }
 
     //Johns-Hopkins top tagger
+
+    // prefilter: the harder branch is followed once, every working point looks for its first splitting
+    // in it, and only the jets that have one go through the full tagger of that working point
+    findSplits(*it, splits);
+
+    for (unsigned wp = 0; wp < _jhtoptaggers.size(); ++wp) {
+      TaggerOutput& out = taggerOutputs[wp];
+
+      // search for top quark like structure in jet
+      fastjet::PseudoJet top_candidate;
+      if (splitsOnce(splits, it->perp(), wp)) top_candidate = _jhtoptaggers[wp](*it);
     
-    // search for top quark like structure in jet
-    fastjet::PseudoJet top_candidate = _jhtoptagger(*it);
-    
-    if (top_candidate == 0){ 
+      if (top_candidate == 0){ 
       
-      lccTopTaggerOut->addElement(new ReconstructedParticleImpl());
-      lccTopTaggerWOut->addElement(new ReconstructedParticleImpl());
-      lccTopTaggernonWOut->addElement(new ReconstructedParticleImpl());
-      lccTopTaggerW1Out->addElement(new ReconstructedParticleImpl());
-      lccTopTaggerW2Out->addElement(new ReconstructedParticleImpl());
-      lcgTopTaggerCosThetaW->setDoubleVal(index, 0.);
-
-    } else {      
-      // save top candidate
-      ReconstructedParticle* t = _fju->convertFromPseudoJet(top_candidate, top_candidate.constituents(), particleIn);	    
-      lccTopTaggerOut->addElement(t);
-
-      // save W candidate
-      fastjet::PseudoJet top_candidate_W = top_candidate.structure_of<fastjet::JHTopTagger>().W();
-      ReconstructedParticle* W = _fju->convertFromPseudoJet(top_candidate_W, top_candidate_W.constituents(), particleIn);	    
-      lccTopTaggerWOut->addElement(W);
+	// in the sparse output only tagged jets have an entry
+	if (_sparseOutput) continue;
+
+	out.top->addElement(new ReconstructedParticleImpl());
+	out.W->addElement(new ReconstructedParticleImpl());
+	out.nonW->addElement(new ReconstructedParticleImpl());
+	out.W1->addElement(new ReconstructedParticleImpl());
+	out.W2->addElement(new ReconstructedParticleImpl());
+	out.cosThetaWValues->setDoubleVal(index, 0.);
+
+	if (_fju->_constituentIndices) {
+	  out.topIndices.add(PseudoJetList());
+	  out.WIndices.add(PseudoJetList());
+	  out.W1Indices.add(PseudoJetList());
+	  out.W2Indices.add(PseudoJetList());
+	  out.nonWIndices.add(PseudoJetList());
+	}
+
+      } else {      
+	_statsTaggedJets[wp]++;
+	const int candidateIndex = _sparseOutput ? (int)out.parentJetIndices.size() : index;
+	if (_sparseOutput) out.parentJetIndices.push_back(index);
+
+	// save top candidate
+	ReconstructedParticle* t = _fju->convertFromPseudoJet(top_candidate, top_candidate.constituents(), particles, &out.topIndices);	    
+	out.top->addElement(t);
+
+	// save W candidate
+	fastjet::PseudoJet top_candidate_W = top_candidate.structure_of<fastjet::JHTopTagger>().W();
+	ReconstructedParticle* W = _fju->convertFromPseudoJet(top_candidate_W, top_candidate_W.constituents(), particles, &out.WIndices);	    
+	out.W->addElement(W);
       
-      // save part 1 of W candidate
-      fastjet::PseudoJet top_candidate_W1 = top_candidate.structure_of<fastjet::JHTopTagger>().W1();
-      ReconstructedParticle* W1 = _fju->convertFromPseudoJet(top_candidate_W1, top_candidate_W1.constituents(), particleIn);	    
-      lccTopTaggerW1Out->addElement(W1);
+	// save part 1 of W candidate
+	fastjet::PseudoJet top_candidate_W1 = top_candidate.structure_of<fastjet::JHTopTagger>().W1();
+	ReconstructedParticle* W1 = _fju->convertFromPseudoJet(top_candidate_W1, top_candidate_W1.constituents(), particles, &out.W1Indices);	    
+	out.W1->addElement(W1);
       
-      // save part 2 of W candidate
-      fastjet::PseudoJet top_candidate_W2 = top_candidate.structure_of<fastjet::JHTopTagger>().W2();
-      ReconstructedParticle* W2 = _fju->convertFromPseudoJet(top_candidate_W2, top_candidate_W2.constituents(), particleIn);	    
-      lccTopTaggerW2Out->addElement(W2);    
-
-      // save non-W subjet of top candidate
-      fastjet::PseudoJet top_candidate_nonW = top_candidate.structure_of<fastjet::JHTopTagger>().non_W();
-      ReconstructedParticle* nonW = _fju->convertFromPseudoJet(top_candidate_nonW, top_candidate_nonW.constituents(), particleIn);	    
-      lccTopTaggernonWOut->addElement(nonW);
+	// save part 2 of W candidate
+	fastjet::PseudoJet top_candidate_W2 = top_candidate.structure_of<fastjet::JHTopTagger>().W2();
+	ReconstructedParticle* W2 = _fju->convertFromPseudoJet(top_candidate_W2, top_candidate_W2.constituents(), particles, &out.W2Indices);	    
+	out.W2->addElement(W2);    
+
+	// save non-W subjet of top candidate
+	fastjet::PseudoJet top_candidate_nonW = top_candidate.structure_of<fastjet::JHTopTagger>().non_W();
+	ReconstructedParticle* nonW = _fju->convertFromPseudoJet(top_candidate_nonW, top_candidate_nonW.constituents(), particles, &out.nonWIndices);	    
+	out.nonW->addElement(nonW);
          
-      // save the polarisation angle of W
-      double top_candidate_cos_theta_W = top_candidate.structure_of<fastjet::JHTopTagger>().cos_theta_W();
-      lcgTopTaggerCosThetaW->setDoubleVal(index, top_candidate_cos_theta_W);
+	// save the polarisation angle of W
+	double top_candidate_cos_theta_W = top_candidate.structure_of<fastjet::JHTopTagger>().cos_theta_W();
+	out.cosThetaWValues->setDoubleVal(candidateIndex, top_candidate_cos_theta_W);
 
+      }
     }
   }
 
+  if (_fju->_constituentIndices) {
+    jetIndices.store(lccJetsOut, _lcParticleInName);
+  }
+  _fju->storeJetAreas(jets, cs, lccJetsOut);
+  _fju->storeBackground(*clustering, lccJetsOut);
+  if (result.budgetFallback) {
+    lccJetsOut->parameters().setValue(std::string("TimeBudgetFallback"), int(1));
+  }
   evt->addCollection(lccJetsOut, _lcJetOutName);
   if (_storeParticlesInJets) evt->addCollection(lccParticlesOut, _lcParticleOutName);
   
@@ -364,14 +550,9 @@ void FastJetTopTagger::processEvent(LCEvent * evt){
     evt->addCollection(lccSubStructure, _lcSubStructureOutName);
   }
 
-  evt->addCollection(lccTopTaggerOut, _lcTopTaggerOutName);
-  evt->addCollection(lccTopTaggerWOut, _lcTopTaggerOutName+"_W");
-  evt->addCollection(lccTopTaggernonWOut, _lcTopTaggerOutName+"_nonW");
-  evt->addCollection(lccTopTaggerW1Out, _lcTopTaggerOutName+"_W1");
-  evt->addCollection(lccTopTaggerW2Out, _lcTopTaggerOutName+"_W2");
-
-  lccTopTaggerCosThetaW->addElement(lcgTopTaggerCosThetaW);  
-  evt->addCollection(lccTopTaggerCosThetaW, _lcTopTaggerOutName+"_cos_theta_W");
+  for (unsigned wp = 0; wp < taggerOutputs.size(); ++wp) {
+    addTaggerOutput(evt, taggerOutputs[wp], wp);
+  }
   
   // special case for the exclusive jet mode: we can save the transition y_cut value
   if (_fju->_clusterMode == FJ_exclusive_nJets && jets.size() == _fju->_requestedNumberOfJets) {
@@ -413,6 +594,44 @@ void FastJetTopTagger::end()
     << " - Skipped Events after max nr of iterations reached: " << _statsNrSkippedMaxIterations
     << " - Skipped Search for Fixed Nr Jets (due to insufficient nr of particles):" << _statsNrSkippedFixedNrJets
     << std::endl;
+
+  if (_fju->_eventTimeBudget > 0) {
+    streamlog_out(MESSAGE)
+      << "Events over the time budget of " << _fju->_eventTimeBudget << " s, finished with the fallback settings: " << _statsNrBudgetFallbacks
+      << std::endl;
+  }
+
+  for (unsigned wp = 0; wp < _statsTaggedJets.size(); ++wp) {
+    streamlog_out(MESSAGE)
+      << "Top tagged jets (" << taggerOutputName(wp) << "): " << _statsTaggedJets[wp]
+      << " (" << (_statsFoundJets > 0 ? 100.0*_statsTaggedJets[wp]/_statsFoundJets : 0.0) << "%)"
+      << std::endl;
+  }
+
+  if (_fju->_shareClusterSequence) {
+    streamlog_out(MESSAGE)
+      << "ClusterSequence cache hits: " << _fju->_statsCacheHits
+      << " - misses: " << _fju->_statsCacheMisses
+      << std::endl;
+  }
+
+  if (_fju->_inputSelection) {
+    streamlog_out(MESSAGE)
+      << "Input particles: " << _fju->_statsInputParticles
+      << " - selected for clustering: " << _fju->_statsSelectedParticles
+      << " (" << (_fju->_statsInputParticles > 0 ? 100.0*_fju->_statsSelectedParticles/_fju->_statsInputParticles : 0.0) << "%)"
+      << std::endl;
+  }
+
+  if (_fju->_backgroundEstimation) {
+    streamlog_out(MESSAGE)
+      << "Average background density rho: " << (_fju->_statsRhoEvents > 0 ? _fju->_statsRhoSum/_fju->_statsRhoEvents : 0.0)
+      << std::endl;
+  }
+
+  _fju->printTimingSummary();
+
+  streamlog_out(MESSAGE) << "Diagnostics: " << _fju->_diagnostics.summary() << std::endl;
 } //end end
 
 std::ostream& operator<<(std::ostream& ostr, const fastjet::PseudoJet& jet){
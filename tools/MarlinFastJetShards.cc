@@ -0,0 +1,514 @@
+/*
+ * MarlinFastJetShards.cc
+ *
+ * Runs one Marlin job as several worker processes on the same machine. The input file is split
+ * into consecutive event ranges, one per worker, each worker runs the unchanged steering file on
+ * its range. Afterwards the LCIO outputs are merged in the original event order and the end of
+ * job statistics of the FastJetProcessors are added up into one report.
+ *
+ * Usage:
+ *   MarlinFastJetShards [-n workers] [-o OutputProcessor=merged.slcio] [-m Marlin] [-k]
+ *                       steering.xml input.slcio [further Marlin options]
+ *
+ *   -n  number of worker processes, by default the number of cores
+ *   -o  name of the LCIOOutputProcessor in the steering file and the merged output file, required if
+ *       the steering file defines an LCIOOutputProcessor, otherwise all workers would write to its file
+ *   -m  the Marlin executable
+ *   -k  keep the shard files and logs in the working directory
+ *
+ * Each worker gets the environment variables MARLINFASTJET_SHARD (its number, appended to the
+ * jet cache and jet column files of the FastJetProcessors) and MARLINFASTJET_STATISTICS (the
+ * file the FastJetProcessors write their statistics to). The statistics of different
+ * configurations, or of workers with different processors, are not merged.
+ */
+
+#include <IO/LCReader.h>
+#include <IO/LCWriter.h>
+#include <IO/LCEventListener.h>
+#include <IO/LCRunListener.h>
+#include <IOIMPL/LCFactory.h>
+#include <EVENT/LCEvent.h>
+#include <EVENT/LCIO.h>
+#include <EVENT/LCRunHeader.h>
+#include <IMPL/LCRunHeaderImpl.h>
+
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+  /// writes consecutive event ranges of the input to one file each
+  class Splitter : public IO::LCEventListener, public IO::LCRunListener {
+  public:
+    Splitter(const std::vector<std::string>& fileNames, const std::vector<long>& nEvents)
+      : _fileNames(fileNames), _nEvents(nEvents), _shard(0), _written(0),
+	_writer(IOIMPL::LCFactory::getInstance()->createLCWriter()), _open(false), _runHeader() {}
+
+    ~Splitter() { close(); }
+
+    void processRunHeader(EVENT::LCRunHeader* hdr) {
+      // the copy is kept for the next shard, the reader reuses its run header
+      _runHeader.reset(new IMPL::LCRunHeaderImpl());
+      _runHeader->setRunNumber(hdr->getRunNumber());
+      _runHeader->setDetectorName(hdr->getDetectorName());
+      _runHeader->setDescription(hdr->getDescription());
+      copyParameters(hdr->getParameters(), _runHeader->parameters());
+      // a run starting right after a full shard goes to the next one
+      if (_open && _written < _nEvents[_shard]) _writer->writeRunHeader(hdr);
+    }
+    void modifyRunHeader(EVENT::LCRunHeader*) {}
+
+    void processEvent(EVENT::LCEvent* evt) {
+      while (_shard < _nEvents.size() && _written == _nEvents[_shard]) {
+	close();
+	++_shard;
+	_written = 0;
+      }
+      if (_shard == _nEvents.size()) return;
+      if (!_open) {
+	_writer->open(_fileNames[_shard], EVENT::LCIO::WRITE_NEW);
+	_open = true;
+	if (_runHeader) _writer->writeRunHeader(_runHeader.get());
+      }
+      _writer->writeEvent(evt);
+      ++_written;
+    }
+    void modifyEvent(EVENT::LCEvent*) {}
+
+    void close() {
+      if (_open) _writer->close();
+      _open = false;
+    }
+
+  private:
+    static void copyParameters(const EVENT::LCParameters& from, EVENT::LCParameters& to) {
+      EVENT::StringVec keys;
+      from.getIntKeys(keys);
+      for (unsigned i = 0; i < keys.size(); ++i) {
+	EVENT::IntVec values;
+	to.setValues(keys[i], from.getIntVals(keys[i], values));
+      }
+      keys.clear();
+      from.getFloatKeys(keys);
+      for (unsigned i = 0; i < keys.size(); ++i) {
+	EVENT::FloatVec values;
+	to.setValues(keys[i], from.getFloatVals(keys[i], values));
+      }
+      keys.clear();
+      from.getStringKeys(keys);
+      for (unsigned i = 0; i < keys.size(); ++i) {
+	EVENT::StringVec values;
+	to.setValues(keys[i], from.getStringVals(keys[i], values));
+      }
+    }
+
+    std::vector<std::string> _fileNames;
+    std::vector<long> _nEvents;
+    unsigned _shard;
+    long _written;
+    std::unique_ptr<IO::LCWriter> _writer;
+    bool _open;
+    std::unique_ptr<IMPL::LCRunHeaderImpl> _runHeader;
+  };
+
+  /// appends the shard outputs to one file, run headers repeated at the start of a shard are dropped
+  class Merger : public IO::LCEventListener, public IO::LCRunListener {
+  public:
+    explicit Merger(IO::LCWriter* writer): _writer(writer), _lastRun(-1), _haveRun(false) {}
+
+    void processRunHeader(EVENT::LCRunHeader* hdr) {
+      if (_haveRun && hdr->getRunNumber() == _lastRun) return;
+      _writer->writeRunHeader(hdr);
+      _lastRun = hdr->getRunNumber();
+      _haveRun = true;
+    }
+    void modifyRunHeader(EVENT::LCRunHeader*) {}
+
+    void processEvent(EVENT::LCEvent* evt) { _writer->writeEvent(evt); }
+    void modifyEvent(EVENT::LCEvent*) {}
+
+  private:
+    IO::LCWriter* _writer;
+    int _lastRun;
+    bool _haveRun;
+  };
+
+  /// the statistics of one processor, added up over the workers
+  struct Statistics {
+    std::string configuration;
+    std::vector<std::string> keys;
+    std::map<std::string, double> values;
+  };
+  typedef std::map<std::string, Statistics> StatisticsMap;
+
+  /// reads the blocks written by FastJetProcessor::writeStatistics
+  bool readStatistics(const std::string& fileName, StatisticsMap& stats) {
+    std::ifstream in(fileName.c_str());
+    if (!in) return false;
+    std::string line, processor;
+    while (std::getline(in, line)) {
+      const std::string::size_type space = line.find(' ');
+      const std::string key = line.substr(0, space);
+      const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+      if (key == "processor") {
+	processor = value;
+	if (stats.count(processor)) return false;
+      } else if (key == "configuration") {
+	stats[processor].configuration = value;
+      } else if (key == "end") {
+	processor.clear();
+      } else if (!processor.empty()) {
+	stats[processor].keys.push_back(key);
+	stats[processor].values[key] = atof(value.c_str());
+      }
+    }
+    return true;
+  }
+
+  /// adds the statistics of one worker, false if they do not belong to the same job
+  bool addStatistics(StatisticsMap& total, const StatisticsMap& shard, std::string& error) {
+    if (total.empty()) {
+      total = shard;
+      return true;
+    }
+    if (shard.size() != total.size()) {
+      error = "the workers ran different processors";
+      return false;
+    }
+    for (StatisticsMap::const_iterator it = shard.begin(); it != shard.end(); ++it) {
+      StatisticsMap::iterator t = total.find(it->first);
+      if (t == total.end()) {
+	error = "the processor " + it->first + " did not run in all workers";
+	return false;
+      }
+      if (t->second.configuration != it->second.configuration) {
+	error = "the processor " + it->first + " ran with different settings: " + t->second.configuration + " and " + it->second.configuration;
+	return false;
+      }
+      for (std::map<std::string, double>::const_iterator v = it->second.values.begin(); v != it->second.values.end(); ++v) {
+	t->second.values[v->first] += v->second;
+      }
+    }
+    return true;
+  }
+
+  void printStatistics(const StatisticsMap& total) {
+    for (StatisticsMap::const_iterator it = total.begin(); it != total.end(); ++it) {
+      std::map<std::string, double> v = it->second.values;
+      std::cout << it->first << " (" << it->second.configuration << ")" << std::endl
+		<< "  Found jets: " << v["FoundJets"]
+		<< " (" << (v["Events"] > 0 ? v["FoundJets"]/v["Events"] : 0.0) << " per event)"
+		<< " - Skipped Empty events: " << v["SkippedEmptyEvents"]
+		<< " - Skipped Events after max nr of iterations reached: " << v["SkippedMaxIterations"]
+		<< " - Skipped Search for Fixed Nr Jets: " << v["SkippedFixedNrJets"] << std::endl
+		<< "  Clustering time: " << v["ClusteringTime"] << " s"
+		<< " (" << (v["Clusterings"] > 0 ? 1000.0*v["ClusteringTime"]/v["Clusterings"] : 0.0) << " ms per event, summed over the workers)"
+		<< std::endl;
+      for (unsigned i = 0; i < it->second.keys.size(); ++i) {
+	std::cout << "  " << it->second.keys[i] << ": " << v[it->second.keys[i]] << std::endl;
+      }
+    }
+  }
+
+  /// the value of an attribute in the text of an XML tag, empty if there is none
+  std::string attribute(const std::string& tag, const std::string& name) {
+    std::string::size_type pos = 0;
+    while ((pos = tag.find(name, pos)) != std::string::npos) {
+      const bool start = pos > 0 && isspace((unsigned char)tag[pos-1]);
+      pos += name.size();
+      std::string::size_type eq = tag.find_first_not_of(" \t\r\n", pos);
+      if (!start || eq == std::string::npos || tag[eq] != '=') continue;
+      const std::string::size_type quote = tag.find_first_of("\"'", eq + 1);
+      if (quote == std::string::npos) break;
+      const std::string::size_type end = tag.find(tag[quote], quote + 1);
+      if (end == std::string::npos) break;
+      return tag.substr(quote + 1, end - quote - 1);
+    }
+    return "";
+  }
+
+  /// the names of the LCIOOutputProcessors defined in the steering file, false if it cannot be read
+  bool outputProcessors(const std::string& steeringFile, std::vector<std::string>& names) {
+    std::ifstream in(steeringFile.c_str());
+    if (!in) return false;
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string text = buffer.str();
+
+    // processors in comments are not defined
+    std::string::size_type comment;
+    while ((comment = text.find("<!--")) != std::string::npos) {
+      const std::string::size_type end = text.find("-->", comment);
+      text.erase(comment, end == std::string::npos ? std::string::npos : end + 3 - comment);
+    }
+
+    std::string::size_type pos = 0;
+    while ((pos = text.find("<processor", pos)) != std::string::npos) {
+      const std::string::size_type end = text.find('>', pos);
+      const std::string tag = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+      pos += 10;
+      if (tag.size() > 10 && !isspace((unsigned char)tag[10])) continue;
+      if (attribute(tag, "type") == "LCIOOutputProcessor") names.push_back(attribute(tag, "name"));
+    }
+    return true;
+  }
+
+  /// copies the end of a log file to stderr
+  void printLogTail(const std::string& logFile, unsigned nLines) {
+    std::ifstream in(logFile.c_str());
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line)) {
+      lines.push_back(line);
+      if (lines.size() > nLines) lines.erase(lines.begin());
+    }
+    for (unsigned i = 0; i < lines.size(); ++i) std::cerr << "  " << lines[i] << std::endl;
+  }
+
+  /// starts Marlin with the output going to logFile, returns the process id
+  pid_t startWorker(const std::vector<std::string>& args, unsigned shard, const std::string& statisticsFile, const std::string& logFile) {
+    const pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    std::ostringstream shardName;
+    shardName << shard;
+    setenv("MARLINFASTJET_SHARD", shardName.str().c_str(), 1);
+    setenv("MARLINFASTJET_STATISTICS", statisticsFile.c_str(), 1);
+    const int log = ::open(logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0) {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+      ::close(log);
+    }
+
+    std::vector<char*> argv;
+    for (unsigned i = 0; i < args.size(); ++i) argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    execvp(argv[0], &argv[0]);
+    perror(argv[0]);
+    _exit(127);
+  }
+
+  void usage() {
+    std::cerr << "usage: MarlinFastJetShards [-n workers] [-o OutputProcessor=merged.slcio] [-m Marlin] [-k]"
+	      << " steering.xml input.slcio [further Marlin options]" << std::endl;
+  }
+
+}
+
+
+int main(int argc, char** argv) {
+
+  unsigned nWorkers = std::thread::hardware_concurrency();
+  std::string outputProcessor, outputFile, marlin = "Marlin";
+  bool keep = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+n:o:m:k")) != -1) {
+    switch (opt) {
+    case 'n': nWorkers = atoi(optarg); break;
+    case 'o': {
+      const std::string value = optarg;
+      const std::string::size_type eq = value.find('=');
+      if (eq == std::string::npos) {
+	usage();
+	return 1;
+      }
+      outputProcessor = value.substr(0, eq);
+      outputFile = value.substr(eq + 1);
+      break;
+    }
+    case 'm': marlin = optarg; break;
+    case 'k': keep = true; break;
+    default: usage(); return 1;
+    }
+  }
+  if (argc - optind < 2 || nWorkers == 0) {
+    usage();
+    return 1;
+  }
+  const std::string steeringFile = argv[optind];
+  const std::string inputFile = argv[optind + 1];
+  std::vector<std::string> marlinOptions(argv + optind + 2, argv + argc);
+
+  // the workers must not write to the same output file
+  std::vector<std::string> outputs;
+  if (!outputProcessors(steeringFile, outputs)) {
+    std::cerr << "Cannot read the steering file " << steeringFile << std::endl;
+    return 1;
+  }
+  for (unsigned i = 0; i < outputs.size(); ++i) {
+    if (outputs[i] != outputProcessor) {
+      std::cerr << "The steering file defines the LCIOOutputProcessor " << outputs[i]
+		<< ", give it with -o " << outputs[i] << "=merged.slcio. Only one output processor is supported" << std::endl;
+      return 1;
+    }
+  }
+
+  std::ostringstream dirName;
+  dirName << "MarlinFastJetShards." << getpid();
+  const std::string workDir = dirName.str();
+  if (mkdir(workDir.c_str(), 0755) != 0) {
+    perror(workDir.c_str());
+    return 1;
+  }
+
+  std::vector<std::string> shardInputs, shardOutputs, statisticsFiles, logFiles;
+  std::vector<long> shardEvents;
+
+  // removes the files of the shards and the working directory, unless they are to be kept
+  auto cleanUp = [&]() {
+    if (keep) return;
+    for (unsigned k = 0; k < shardInputs.size(); ++k) {
+      remove(shardInputs[k].c_str());
+      remove(shardOutputs[k].c_str());
+      remove(statisticsFiles[k].c_str());
+      remove(logFiles[k].c_str());
+    }
+    rmdir(workDir.c_str());
+  };
+
+  try {
+    // consecutive event ranges of nearly equal size
+    std::unique_ptr<IO::LCReader> reader(IOIMPL::LCFactory::getInstance()->createLCReader());
+    reader->open(inputFile);
+    const long nEvents = reader->getNumberOfEvents();
+    reader->close();
+    if (nEvents <= 0) {
+      std::cerr << "No events in " << inputFile << std::endl;
+      cleanUp();
+      return 1;
+    }
+    if ((long)nWorkers > nEvents) nWorkers = nEvents;
+
+    for (unsigned k = 0; k < nWorkers; ++k) {
+      std::ostringstream base;
+      base << workDir << "/shard" << k;
+      shardInputs.push_back(base.str() + ".in.slcio");
+      shardOutputs.push_back(base.str() + ".out.slcio");
+      statisticsFiles.push_back(base.str() + ".stats");
+      logFiles.push_back(base.str() + ".log");
+      shardEvents.push_back(nEvents/nWorkers + ((long)k < nEvents % nWorkers ? 1 : 0));
+    }
+
+    std::cout << "Splitting " << nEvents << " events of " << inputFile << " into " << nWorkers << " shards" << std::endl;
+    Splitter splitter(shardInputs, shardEvents);
+    reader.reset(IOIMPL::LCFactory::getInstance()->createLCReader());
+    reader->registerLCEventListener(&splitter);
+    reader->registerLCRunListener(&splitter);
+    reader->open(inputFile);
+    reader->readStream();
+    reader->close();
+    splitter.close();
+  } catch (const std::exception& e) {
+    std::cerr << "Cannot split " << inputFile << ": " << e.what() << std::endl;
+    cleanUp();
+    return 1;
+  }
+
+  // run the workers
+  std::vector<pid_t> workers;
+  for (unsigned k = 0; k < nWorkers; ++k) {
+    std::vector<std::string> args;
+    args.push_back(marlin);
+    args.push_back(steeringFile);
+    args.push_back("--global.LCIOInputFiles=" + shardInputs[k]);
+    if (!outputProcessor.empty()) {
+      args.push_back("--" + outputProcessor + ".LCIOOutputFile=" + shardOutputs[k]);
+    }
+    args.insert(args.end(), marlinOptions.begin(), marlinOptions.end());
+    const pid_t pid = startWorker(args, k, statisticsFiles[k], logFiles[k]);
+    if (pid < 0) {
+      perror("fork");
+      // stop the workers already running, their results would be incomplete
+      for (unsigned w = 0; w < workers.size(); ++w) kill(workers[w], SIGTERM);
+      for (unsigned w = 0; w < workers.size(); ++w) waitpid(workers[w], NULL, 0);
+      cleanUp();
+      return 1;
+    }
+    workers.push_back(pid);
+  }
+
+  bool failed = false;
+  for (unsigned k = 0; k < workers.size(); ++k) {
+    int status = 0;
+    if (waitpid(workers[k], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << "Worker " << k << " failed, the end of its log " << logFiles[k] << ":" << std::endl;
+      printLogTail(logFiles[k], 20);
+      failed = true;
+    }
+  }
+  if (failed) {
+    cleanUp();
+    return 1;
+  }
+
+  // add up the statistics, refuse results of different settings
+  StatisticsMap total;
+  unsigned nStatistics = 0;
+  for (unsigned k = 0; k < nWorkers; ++k) {
+    // a job without FastJetProcessor writes no statistics
+    if (access(statisticsFiles[k].c_str(), F_OK) != 0) continue;
+    StatisticsMap shard;
+    std::string error;
+    if (!readStatistics(statisticsFiles[k], shard)) {
+      std::cerr << "Cannot read the statistics of worker " << k << " in " << statisticsFiles[k] << std::endl;
+      cleanUp();
+      return 1;
+    }
+    if (!addStatistics(total, shard, error)) {
+      std::cerr << "Not merging the results of worker " << k << ": " << error << std::endl;
+      cleanUp();
+      return 1;
+    }
+    ++nStatistics;
+  }
+  if (nStatistics != 0 && nStatistics != nWorkers) {
+    std::cerr << "Not merging the results: only " << nStatistics << " of " << nWorkers << " workers wrote statistics" << std::endl;
+    cleanUp();
+    return 1;
+  }
+
+  if (!outputProcessor.empty()) {
+    try {
+      std::unique_ptr<IO::LCWriter> writer(IOIMPL::LCFactory::getInstance()->createLCWriter());
+      writer->open(outputFile, EVENT::LCIO::WRITE_NEW);
+      Merger merger(writer.get());
+      for (unsigned k = 0; k < nWorkers; ++k) {
+	std::unique_ptr<IO::LCReader> reader(IOIMPL::LCFactory::getInstance()->createLCReader());
+	reader->registerLCEventListener(&merger);
+	reader->registerLCRunListener(&merger);
+	reader->open(shardOutputs[k]);
+	reader->readStream();
+	reader->close();
+      }
+      writer->close();
+      std::cout << "Merged the output of " << nWorkers << " workers into " << outputFile << std::endl;
+    } catch (const std::exception& e) {
+      std::cerr << "Cannot merge the output into " << outputFile << ": " << e.what() << std::endl;
+      cleanUp();
+      return 1;
+    }
+  }
+
+  printStatistics(total);
+
+  cleanUp();
+  return 0;
+}